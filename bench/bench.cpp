@@ -0,0 +1,422 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <cstdio>
+
+#include "FAT.h"
+#include "fs.h"
+#include "arena.h"
+#include "image.h"
+
+// Commands print OK and file content, benchmarks dont want to measure terminal
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+// One measured configuration, params are already formatted as json members
+struct Result
+{
+    std::string name;
+    std::string params;
+    std::string unit;
+    double median;
+    double min;
+};
+
+// Benchmarks of loading, lookup, file I/O and allocation, friend of FAT so internals can be measured one by one
+class Bench
+{
+public:
+    Bench(const std::string& dir, uint32 reps);
+    void run();
+    void printJson(std::ostream& out);
+private:
+    void benchLoad();
+    void benchFind();
+    void benchFileIO();
+    void benchFindFree();
+    void benchUpdateFat();
+
+    void createImage(const std::string& filename, int32 clusterCount, int16 clusterSize);
+    void buildTree(const std::string& filename, uint32 depth, uint32 fanout, bool comb);
+    Node* mkdir(FAT& fat, Node* parent, const std::string& name);
+    void fill(FAT& fat, uint32 percent);
+    std::vector<double> measure(std::function<void()> setup, std::function<void()> body);
+    void add(const std::string& name, const std::string& params, const std::string& unit, std::vector<double> values, double scale);
+
+    std::string dir;
+    uint32 reps;
+    std::mt19937 eng;
+    std::vector<Result> results;
+};
+
+Bench::Bench(const std::string& _dir, uint32 _reps)
+    : dir(_dir)
+    , reps(_reps)
+    , eng(42)
+{
+}
+
+void Bench::run()
+{
+    benchLoad();
+    benchFind();
+    benchFileIO();
+    benchFindFree();
+    benchUpdateFat();
+}
+
+// Empty fat with only root dir, data part is left sparse so big images cost nothing
+void Bench::createImage(const std::string& filename, int32 clusterCount, int16 clusterSize)
+{
+    std::remove(filename.c_str());
+    std::remove((filename + ".journal").c_str());
+    ImageIO image(filename, false, true);
+    if (!image.opened())
+        throw std::runtime_error("Cant create bench image!");
+
+    BootRecord br;
+    memset(&br, 0, sizeof(BootRecord));
+    strcpy(br.volume_descriptor, "bench fat");
+    strcpy(br.signature, "bench");
+    br.cluster_size = clusterSize;
+    br.usable_cluster_count = clusterCount;
+    br.fat_type = 8;
+    br.fat_copies = 2;
+
+    std::vector<int32> fat(clusterCount, FAT_UNUSED);
+    fat[0] = FAT_DIRECTORY;
+
+    size_t tableSize = sizeof(int32)*clusterCount;
+    image.write(&br, sizeof(BootRecord), 0);
+    for (uint8 i = 0; i < br.fat_copies; i++)
+        image.write(fat.data(), tableSize, sizeof(BootRecord) + (uint64)i*tableSize);
+    if (!image.truncate(sizeof(BootRecord) + (uint64)br.fat_copies*tableSize + (uint64)clusterCount*clusterSize))
+        throw std::runtime_error("Cant create bench image!");
+}
+
+// Same as createDir but without path lookup, so building big trees doesnt measure find
+Node* Bench::mkdir(FAT& fat, Node* parent, const std::string& name)
+{
+    fat.freeSlot(parent, name.c_str());
+    int32 cluster = fat.findFreeCluster();
+    if (cluster == -1)
+        throw std::runtime_error("Not enough disc space");
+    Node* child = new (*fat.arenas[0]) Node(name.c_str(), cluster, false, 0, parent);
+    fat.setCluster(cluster, FAT_DIRECTORY);
+    fat.prepareDir(child, *fat.arenas[0]);
+    child->loaded = true;
+    fat.addEntry(parent, child);
+    return child;
+}
+
+// Tree of dirs, every dir have fanout subdirs up to depth, comb have subdirs only in its last dir on every level
+void Bench::buildTree(const std::string& filename, uint32 depth, uint32 fanout, bool comb)
+{
+    uint32 dirs = 0;
+    for (uint32 level = 0, width = 1; level < depth; level++)
+    {
+        width = comb ? fanout : width*fanout;
+        dirs += width;
+    }
+    createImage(filename, dirs + 64, 4096);
+
+    FAT fat(filename);
+    fat.setDeferred(true);
+    std::vector<Node*> level(1, fat.root);
+    for (uint32 i = 0; i < depth; i++)
+    {
+        std::vector<Node*> next;
+        for (auto parent : level)
+            for (uint32 j = 0; j < fanout; j++)
+                next.push_back(mkdir(fat, parent, "d" + std::to_string(j)));
+        if (comb)
+            next.erase(next.begin(), next.end() - 1);
+        level.swap(next);
+    }
+    fat.sync();
+}
+
+// Mark random clusters used until percent of them is taken
+void Bench::fill(FAT& fat, uint32 percent)
+{
+    std::uniform_int_distribution<> distr(0, 99);
+    for (int32 cluster = 1; cluster < fat.br.usable_cluster_count; cluster++)
+        if ((uint32)distr(eng) < percent)
+            fat.setCluster(cluster, FAT_FILE_END);
+    // Only in memory state is measured, nothing needs to be written
+    for (auto& ranges : fat.dirtyFat)
+        ranges.clear();
+}
+
+// Time body reps times, setup before every run is not measured, returns seconds
+std::vector<double> Bench::measure(std::function<void()> setup, std::function<void()> body)
+{
+    std::vector<double> times;
+    for (uint32 i = 0; i < reps; i++)
+    {
+        if (setup)
+            setup();
+        auto start = std::chrono::steady_clock::now();
+        body();
+        times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return times;
+}
+
+// Values are multiplied by scale, throughputs pass negative scale which is divided by time instead
+void Bench::add(const std::string& name, const std::string& params, const std::string& unit, std::vector<double> values, double scale)
+{
+    for (auto& value : values)
+        value = scale < 0 ? -scale / value : value*scale;
+    std::sort(values.begin(), values.end());
+
+    Result result;
+    result.name = name;
+    result.params = params;
+    result.unit = unit;
+    result.median = values[values.size() / 2];
+    // For throughput best run is the biggest one
+    result.min = scale < 0 ? values.back() : values.front();
+    results.push_back(result);
+}
+
+// Whole tree load for wide and deep trees of similar size, page cache is warm after first run
+void Bench::benchLoad()
+{
+    struct Shape
+    {
+        const char* name;
+        uint32 depth;
+        uint32 fanout;
+    };
+    const Shape shapes[] = { { "wide", 2, 100 }, { "deep", 8, 3 } };
+    for (auto& shape : shapes)
+    {
+        std::string filename = dir + "/bench_tree.fat";
+        buildTree(filename, shape.depth, shape.fanout, false);
+        for (uint8 threads : { 1, 2, 4, 8 })
+        {
+            FAT::max_threads = threads;
+            std::ostringstream params;
+            params << "\"shape\": \"" << shape.name << "\", \"depth\": " << shape.depth << ", \"fanout\": " << shape.fanout
+                << ", \"threads\": " << (int)threads;
+            add("load", params.str(), "ms", measure(nullptr, [&]() { FAT fat(filename); }), 1e3);
+        }
+        std::remove(filename.c_str());
+    }
+    FAT::max_threads = THREADS;
+}
+
+// Lookup of deepest dir of comb, at every level it have to be found between fanout dirs
+void Bench::benchFind()
+{
+    const uint32 iterations = 10000;
+    std::string filename = dir + "/bench_find.fat";
+    for (uint32 depth : { 1, 4, 16 })
+        for (uint32 fanout : { 4, 32, 128 })
+        {
+            buildTree(filename, depth, fanout, true);
+            FAT fat(filename);
+            std::string path;
+            for (uint32 i = 0; i < depth; i++)
+                path += "/d" + std::to_string(fanout - 1);
+            if (!fat.find(fat.root, path))
+                throw std::runtime_error("Path not found");
+
+            std::ostringstream params;
+            params << "\"depth\": " << depth << ", \"fanout\": " << fanout;
+            add("find", params.str(), "ns", measure(nullptr, [&]()
+            {
+                for (uint32 i = 0; i < iterations; i++)
+                    fat.find(fat.root, path);
+            }), 1e9 / iterations);
+        }
+    std::remove(filename.c_str());
+}
+
+// Import and print of one file, every run imports it into its own dir
+void Bench::benchFileIO()
+{
+    const uint32 fileSize = 16 << 20;
+    const double megabytes = (double)fileSize / (1 << 20);
+    std::string source = dir + "/bench.dat";
+    {
+        std::vector<char> data(fileSize);
+        std::uniform_int_distribution<> distr('a', 'z');
+        for (auto& c : data)
+            c = (char)distr(eng);
+        std::ofstream out(source, std::ios::binary);
+        out.write(data.data(), data.size());
+    }
+
+    std::string filename = dir + "/bench_io.fat";
+    for (int16 clusterSize : { 512, 4096, 16384 })
+    {
+        createImage(filename, (int32)(reps*(fileSize / clusterSize) + 64), clusterSize);
+        FAT fat(filename);
+        std::vector<Node*> files;
+        uint32 run = 0;
+
+        std::ostringstream params;
+        params << "\"cluster_size\": " << clusterSize << ", \"file_mb\": " << megabytes;
+        add("add_file", params.str(), "MB/s", measure([&]()
+        {
+            mkdir(fat, fat.root, "r" + std::to_string(run));
+        }, [&]()
+        {
+            fat.addFile(source, "/r" + std::to_string(run++));
+        }), -megabytes);
+
+        for (uint32 i = 0; i < reps; i++)
+            files.push_back(fat.find(fat.root, "/r" + std::to_string(i) + "/bench.dat"));
+        run = 0;
+        add("print_file", params.str(), "MB/s", measure(nullptr, [&]()
+        {
+            fat._printFile(files[run++]);
+        }), -megabytes);
+    }
+    std::remove(filename.c_str());
+    std::remove(source.c_str());
+}
+
+// Allocation on randomly fragmented fat, single cluster and run of many clusters
+void Bench::benchFindFree()
+{
+    const uint32 iterations = 1000;
+    const int32 clusters = 1 << 20;
+    const int32 runLength = 1024;
+    std::string filename = dir + "/bench_free.fat";
+    for (uint32 percent : { 0, 50, 90, 99 })
+    {
+        createImage(filename, clusters, 512);
+        FAT fat(filename);
+        fill(fat, percent);
+
+        std::ostringstream params;
+        params << "\"clusters\": " << clusters << ", \"fill_percent\": " << percent;
+        // Every found cluster is marked used in free cluster index, so next search must go past it as allocation does.
+        // Fat tables stay untouched, only search is measured. Taken clusters are given back before every run.
+        std::vector<int32> taken;
+        taken.reserve(iterations);
+        auto giveBack = [&]()
+        {
+            for (auto cluster : taken)
+                fat.freeClusters.update(cluster, FAT_FILE_END, FAT_UNUSED);
+            taken.clear();
+        };
+        add("find_free_cluster", params.str(), "ns", measure(giveBack, [&]()
+        {
+            for (uint32 i = 0; i < iterations; i++)
+            {
+                int32 cluster = fat.findFreeCluster();
+                fat.freeClusters.update(cluster, FAT_UNUSED, FAT_FILE_END);
+                taken.push_back(cluster);
+            }
+        }), 1e9 / iterations);
+        giveBack();
+
+        std::vector<Extent> extents;
+        params << ", \"run\": " << runLength;
+        add("find_free_clusters", params.str(), "us", measure([&]() { extents.clear(); }, [&]()
+        {
+            fat.findFreeClusters(extents, runLength);
+        }), 1e6);
+    }
+    std::remove(filename.c_str());
+}
+
+// Write of fat tables after number of scattered entries changed
+void Bench::benchUpdateFat()
+{
+    const int32 clusters = 1 << 20;
+    std::string filename = dir + "/bench_update.fat";
+    createImage(filename, clusters, 512);
+    FAT fat(filename);
+    std::uniform_int_distribution<int32> distr(1, clusters - 1);
+    for (uint32 dirty : { 1, 100, 10000 })
+    {
+        std::ostringstream params;
+        params << "\"clusters\": " << clusters << ", \"dirty\": " << dirty;
+        add("update_fat_tables", params.str(), "us", measure([&]()
+        {
+            for (uint32 i = 0; i < dirty; i++)
+            {
+                int32 cluster = distr(eng);
+                fat.setCluster(cluster, fat.fatTables[0][cluster] == FAT_UNUSED ? FAT_FILE_END : FAT_UNUSED);
+            }
+        }, [&]()
+        {
+            fat.updateFatTables();
+        }), 1e6);
+    }
+    std::remove(filename.c_str());
+}
+
+void Bench::printJson(std::ostream& out)
+{
+    out << "{" << std::endl;
+    out << "  \"repetitions\": " << reps << "," << std::endl;
+    out << "  \"mmap\": " << (FAT::use_mmap ? "true" : "false") << "," << std::endl;
+    out << "  \"results\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        Result& result = results[i];
+        out << "    { \"name\": \"" << result.name << "\", " << result.params << ", \"unit\": \"" << result.unit
+            << "\", \"median\": " << result.median << ", \"best\": " << result.min << " }"
+            << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string dir = ".";
+    uint32 reps = 5;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+            dir = argv[++i];
+        else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--mmap") == 0)
+            FAT::use_mmap = true;
+        else
+        {
+            std::cout << "Usage: " << argv[0] << " [--dir <dir for images>] [--reps <N>] [--mmap]" << std::endl;
+            return 1;
+        }
+    }
+    FAT::max_threads = THREADS;
+
+    // Results go to stdout, everything commands print goes nowhere
+    std::streambuf* stdoutBuffer = std::cout.rdbuf();
+    NullBuffer null;
+    std::ostream json(stdoutBuffer);
+    json.precision(4);
+    std::cout.rdbuf(&null);
+    try
+    {
+        Bench bench(dir, reps);
+        bench.run();
+        bench.printJson(json);
+    }
+    catch (std::exception& e)
+    {
+        std::cout.rdbuf(stdoutBuffer);
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::cout.rdbuf(stdoutBuffer);
+    return 0;
+}
@@ -1,5 +1,16 @@
 #include "FAT.h"
 #include "fs.h"
+#include "arena.h"
+#include "image.h"
+#include "scheduler.h"
+#include "path.h"
+#include "fatscan.h"
+#include "uring.h"
+#include "readahead.h"
+#include "journal.h"
+#include "cache.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <iostream>
 #include <chrono>
@@ -7,29 +18,89 @@
 #include <thread>
 #include <algorithm>
 #include <random>
+#ifdef HAVE_IO_URING
+#include <sys/uio.h>
+#include <cerrno>
+#endif
 
 uint8 FAT::max_threads;
+bool FAT::use_mmap = false;
+bool FAT::lazy_load = false;
+bool FAT::single_fat = false;
+bool FAT::async_load = false;
+bool FAT::use_journal = false;
+bool FAT::hashed_dirs = false;
+uint64 FAT::cache_size = 0;
 FAT::FAT(std::string filename)
     : fatTables(nullptr)
+    , loadedCopies(0)
+    , image(nullptr)
+    , arenas(1, new NodeArena())
     , root(nullptr)
-    , working(0)
-    , dirs(0)
+    , deferWrites(use_journal)
+    , journal(nullptr)
+    , cache(nullptr)
 {
-    file = fopen(filename.c_str(), "r+b");
-    if (!file)
+    // Destructor doesnt run for half made fat, everything allocated so far is released here
+    try
+    {
+        open(filename);
+    }
+    catch (...)
+    {
+        release();
+        throw;
+    }
+}
+
+// Open fat file, replay journal and load tables and tree
+void FAT::open(const std::string& filename)
+{
+    image = new ImageIO(filename);
+    if (!image->opened())
         throw std::runtime_error("Cant open fat file!");
+    if (use_journal && use_mmap)
+        throw std::runtime_error("Journal cant be used with mapped fat file!");
+
+    // Finish transactions committed before crash, journal is replayed even if it is not used now
+    journal = new Journal(image, filename + ".journal", use_journal);
+    if (journal->opened())
+    {
+        TraceSpan span("replay journal");
+        uint32 replayed = journal->replay();
+        if (replayed)
+            std::cout << "Replayed " << replayed << " transactions from journal" << std::endl;
+    }
+    else if (use_journal)
+        throw std::runtime_error("Cant open journal!");
+    if (!use_journal)
+    {
+        delete journal;
+        journal = nullptr;
+    }
 
     loadBootRecod();
+    uint64 start = Trace::now();
     loadFatTables();
+    Trace::span("load fat tables", start);
+    start = Trace::now();
+    freeClusters.build(fatTables[0], br.usable_cluster_count);
+    Trace::span("build bitmap", start);
+    dirtyFat.resize(loadedCopies);
+    // Mapped file is already in memory, cache would only copy it
+    if (cache_size && !image->data())
+        cache = new ClusterCache(image, dataStart, br.cluster_size, cache_size);
     // Load filesystem into tree structure
+    start = Trace::now();
     loadFS();
+    Trace::span("load fs", start);
 }
 
 // Load boot recort into structure
 void FAT::loadBootRecod()
 {
-    size_t res = fread(&br, sizeof(BootRecord), 1, file);
-    if (!res)
+    size_t res = image->read(&br, sizeof(BootRecord), 0);
+    if (res != sizeof(BootRecord))
         throw std::runtime_error("Error while reading boot record!");
 
     // Calculate maximum number of dirs in cluster for later user
@@ -47,31 +118,194 @@ void FAT::loadBootRecod()
 void FAT::loadFatTables()
 {
     fatTables = new int32*[br.fat_copies];
-    memset(fatTables, 0, br.fat_copies);
-    
-    for (uint8 i = 0; i < br.fat_copies; i++)
+    memset(fatTables, 0, sizeof(int32*)*br.fat_copies);
+    size_t tableSize = sizeof(int32)*br.usable_cluster_count;
+    loadedCopies = single_fat ? 1 : br.fat_copies;
+
+    // Clusters start right after last fat table
+    dataStart = sizeof(BootRecord) + (uint64)br.fat_copies*tableSize;
+
+    if (use_mmap)
     {
-        fatTables[i] = new int32[br.usable_cluster_count];
-        size_t res = fread(fatTables[i], sizeof(int32)*br.usable_cluster_count, 1, file);
-        if (!res)
+        if (!image->map())
+            throw std::runtime_error("Cant map fat file!");
+        if (image->size() < clusterOffset(br.usable_cluster_count))
             throw std::runtime_error("Error while reading fat tables!");
+        // Tables are just views into mapping, no copy needed
+        for (uint8 i = 0; i < loadedCopies; i++)
+            fatTables[i] = (int32*)(image->data() + sizeof(BootRecord) + (uint64)i*tableSize);
+    }
+    else
+    {
+        for (uint8 i = 0; i < loadedCopies; i++)
+        {
+            fatTables[i] = new int32[br.usable_cluster_count];
+            size_t res = image->read(fatTables[i], tableSize, sizeof(BootRecord) + (uint64)i*tableSize);
+            if (res != tableSize)
+                throw std::runtime_error("Error while reading fat tables!");
+        }
     }
+    verifyMirrors();
+}
 
-    // Save current position (start of clusters) for future use
-    dataStart = ftell(file);
+// Mirrors which are not loaded are only compared with primary
+void FAT::verifyMirrors()
+{
+    for (uint8 i = loadedCopies; i < br.fat_copies; i++)
+    {
+        int32 diff = findMirrorDiff(i, 0);
+        if (diff >= 0)
+            std::cout << "Fat copy " << (int)i << " differs from primary at cluster " << diff << std::endl;
+    }
+}
+
+// Find first cluster from cluster from where copy differs from primary, -1 if there is not one
+int32 FAT::findMirrorDiff(uint8 copy, int32 from)
+{
+    int32 count = br.usable_cluster_count;
+    if (from >= count)
+        return -1;
+    uint64 tableOffset = sizeof(BootRecord) + (uint64)copy*sizeof(int32)*count;
+
+    // Loaded or mapped copy is compared in place
+    const int32* mirror = copy < loadedCopies ? fatTables[copy] : nullptr;
+    if (!mirror && image->data())
+        mirror = (const int32*)(image->data() + tableOffset);
+    if (mirror)
+    {
+        int32 diff = compareTables(fatTables[0] + from, mirror + from, count - from);
+        return diff < 0 ? -1 : from + diff;
+    }
+
+    // Mirror on disk is streamed through buffer
+    const int32 chunk = IMPORT_CHUNK / sizeof(int32);
+    int32* buffer = new int32[chunk];
+    int32 result = -1;
+    for (int32 start = from; start < count && result < 0; start += chunk)
+    {
+        int32 size = std::min(chunk, count - start);
+        size_t bytes = sizeof(int32)*size;
+        if (image->read(buffer, bytes, tableOffset + sizeof(int32)*start) != bytes)
+        {
+            delete[] buffer;
+            throw std::runtime_error("Error while reading fat tables!");
+        }
+        int32 diff = compareTables(fatTables[0] + start, buffer, size);
+        if (diff >= 0)
+            result = start + diff;
+    }
+    delete[] buffer;
+    return result;
+}
+
+// Collect runs of entries where mirror differs from primary table, mirror on disk is streamed just once
+void FAT::findMirrorDiffs(uint8 copy, std::vector<Extent>& diffs)
+{
+    int32 count = br.usable_cluster_count;
+    uint64 tableOffset = sizeof(BootRecord) + (uint64)copy*sizeof(int32)*count;
+    const int32* mirror = copy < loadedCopies ? fatTables[copy] : nullptr;
+    if (!mirror && image->data())
+        mirror = (const int32*)(image->data() + tableOffset);
+
+    const int32 chunk = IMPORT_CHUNK / sizeof(int32);
+    std::vector<int32> buffer(mirror ? 0 : chunk);
+    for (int32 start = 0; start < count; start += chunk)
+    {
+        int32 size = std::min(chunk, count - start);
+        const int32* entries = mirror ? mirror + start : buffer.data();
+        size_t bytes = sizeof(int32)*size;
+        if (!mirror && image->read(buffer.data(), bytes, tableOffset + sizeof(int32)*start) != bytes)
+            throw std::runtime_error("Error while reading fat tables!");
+
+        for (int32 i = 0; i < size; )
+        {
+            int32 diff = compareTables(fatTables[0] + start + i, entries + i, size - i);
+            if (diff < 0)
+                break;
+            int32 cluster = start + i + diff;
+            // Differing entries next to each other make one run
+            if (!diffs.empty() && diffs.back().start + diffs.back().length == cluster)
+                diffs.back().length++;
+            else
+            {
+                Extent extent = { cluster, 1 };
+                diffs.push_back(extent);
+            }
+            i += diff + 1;
+        }
+    }
 }
 
 // Load direstories and files into tree structure
 void FAT::loadFS()
 {
-    root = new Node("", 0, false, 0, nullptr);
-    dirsToLoad.push_back(root);
-    dirs++;
+    root = new (*arenas[0]) Node("", 0, false, 0, nullptr);
+    // In lazy mode only root is loaded now, other dirs when some path goes through them.
+    // Hashed root is left for probes too, so lookup in it doesnt need to read it whole.
+    if (lazy_load)
+    {
+        if (!hashed_dirs)
+            ensureLoaded(root);
+    }
+    else
+        loadDirs(std::vector<Node*>(1, root));
+}
+
+// Load whole tree, in lazy mode only dirs which werent loaded yet
+void FAT::loadAll()
+{
+    std::vector<Node*> dirs;
+    collectUnloaded(root, dirs);
+    if (!dirs.empty())
+        loadDirs(dirs);
+}
+
+// Collect topmost dirs which werent loaded yet
+void FAT::collectUnloaded(Node* node, std::vector<Node*>& dirs)
+{
+    if (node->isFile)
+        return;
+    if (!node->loaded)
+        dirs.push_back(node);
+    else
+        for (auto child : node->childs)
+            collectUnloaded(child, dirs);
+}
+
+// Load single dir on demand, its subdirs stay unloaded
+void FAT::ensureLoaded(Node* node)
+{
+    if (node->isFile || node->loaded)
+        return;
+    std::vector<Node*> subdirs;
+    loadDir(node, subdirs, *arenas[0]);
+    relocateBadDirsClusters();
+}
+
+// Load dirs and everything under them using worker threads
+void FAT::loadDirs(const std::vector<Node*>& dirs)
+{
+    // Mapped file needs no reads, async loader helps only with real I/O
+    if (async_load && !image->data() && loadDirsAsync(dirs))
+    {
+        relocateBadDirsClusters();
+        return;
+    }
+
+    uint8 workers = std::max((uint8)1, max_threads);
+    while (arenas.size() < workers)
+        arenas.push_back(new NodeArena());
+    WorkScheduler scheduler(workers);
+    for (auto dir : dirs)
+    {
+        DirPart work = { dir, -1, nullptr };
+        scheduler.push(0, work);
+    }
 
     // Create worker vectors to parse fat into filesystem
     std::vector<std::thread*> threads;
-    for (uint8 i = 0; i < std::max((uint8)1,max_threads); i++)
-        threads.push_back(new std::thread(&FAT::dirLoader,this));
+    for (uint8 i = 0; i < workers; i++)
+        threads.push_back(new std::thread(&FAT::dirLoader, this, &scheduler, i));
 
     // Wait for threads and delete them
     for (auto* thread : threads)
@@ -83,362 +317,1045 @@ void FAT::loadFS()
     relocateBadDirsClusters();
 }
 
-// Load directories into buffer from file offset, locking file so other threads doesnt seek somewhere else before fread is executed
-void FAT::secureLoadDirs(char*buffer, long offset)
+// Load directories into buffer from file offset, positional read so threads dont need to lock shared file position
+void FAT::secureLoadDirs(char*buffer, uint64 offset)
 {
-    Guard guard(loadLock);
-    fseek(file, offset, SEEK_SET);
-    fread(buffer, br.cluster_size, 1, file);
+    uint64 start = Trace::now();
+    size_t res = image->read(buffer, br.cluster_size, offset);
+    Trace::span("read dir", start);
+    Stats::add(STAT_DIR_READS);
+    Stats::add(STAT_DIR_READ_BYTES, res);
+    // Short read past end of file, treat rest of cluster as empty so we dont parse garbage
+    if (res < (size_t)br.cluster_size)
+        memset(buffer + res, 0, br.cluster_size - res);
 }
 
-// Consumer method for threads
-void FAT::dirLoader()
+// Offset of cluster in fat file
+uint64 FAT::clusterOffset(int32 cluster)
 {
-    do
+    return dataStart + (uint64)cluster*br.cluster_size;
+}
+
+// Pointer to cluster inside mapped fat file, nullptr if fat file is not mapped
+char* FAT::clusterData(int32 cluster)
+{
+    return image->data() ? image->data() + clusterOffset(cluster) : nullptr;
+}
+
+// Worker method for threads, loads dirs from own deque and steals from others when it runs out of work.
+// Dir with more clusters is split, its clusters are loaded by any worker and last loaded one finishes dir.
+void FAT::dirLoader(WorkScheduler* scheduler, uint8 worker)
+{
+    Trace::threadName("loader " + std::to_string(worker));
+    NodeArena& arena = *arenas[worker];
+    std::vector<Node*> subdirs;
+    uint32 idle = 0;
+    // Whole idle stretch is one span, so waiting cant push loading out of trace ring
+    uint64 waitStart = 0;
+    while (!scheduler->finished())
     {
-        Node* node = nullptr;
+        uint64 start = Trace::now();
+        DirPart work;
+        if (!scheduler->next(worker, work))
         {
-            // Condition lock
-            Guard g1(condLock);
-            // If someone still working and have no work to be done wait for signal
-            while (dirs <= 0 && working)
-                condition.wait(g1);
-
-            // Critic section lock
-            Guard g2(dirsLock);
-            // Retrieve node from workload if there is any
-            if (dirs)
+            // Someone is still loading and may find more dirs, back off so we dont burn cpu the busy worker needs
+            if (!idle)
+                waitStart = start;
+            uint64 idleStart = Stats::now();
+            if (++idle < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            Stats::add(STAT_LOADER_IDLE_NS, Stats::now() - idleStart);
+            continue;
+        }
+        if (idle)
+            Trace::span("wait", waitStart);
+        Trace::span("dequeue", start);
+        idle = 0;
+
+        start = Trace::now();
+        bool finished = true;
+        if (work.part < 0)
+        {
+            prepareDir(work.node, arena);
+            int32 parts = (int32)(work.node->slots.size() / maxDirs);
+            // Other clusters are pushed to own deque, idle workers steal them
+            if (parts > 1)
             {
-                working++;
-                dirs--;
-                node = dirsToLoad.front();
-                dirsToLoad.pop_front();
+                work.remaining = new (arena.allocate(sizeof(std::atomic<int32>))) std::atomic<int32>(parts);
+                for (int32 i = 1; i < parts; i++)
+                {
+                    DirPart part = { work.node, i, work.remaining };
+                    scheduler->push(worker, part);
+                }
             }
-            // End of block call Guards destructors and free locks
+            work.part = parts ? 0 : -1;
         }
-        // If we got node do some work
-        if (node)
-            loadDir(node);
+        if (work.part >= 0)
+            loadDirPart(work.node, work.part, arena);
+        if (work.remaining)
+            finished = --*work.remaining == 0;
+
+        subdirs.clear();
+        if (finished)
+        {
+            finishDir(work.node, subdirs, arena);
+            Stats::add(STAT_DIRS_LOADED);
+        }
+        Trace::span("load dir", start);
+        // Push found dirs before marking this one done, so scheduler never looks finished too early
+        for (auto dir : subdirs)
+        {
+            DirPart next = { dir, -1, nullptr };
+            scheduler->push(worker, next);
+        }
+        scheduler->done();
     }
-    // Well if others working it would be nice if this thread joined too
-    while (working || dirs);
-    condition.notify_all();
+    if (idle)
+        Trace::span("wait", waitStart);
 }
 
-// Load dir content into filesystem
-void FAT::loadDir(Node* parent)
+// Load dir content into filesystem, found subdirectories are returned in subdirs
+void FAT::loadDir(Node* parent, std::vector<Node*>& subdirs, NodeArena& arena)
 {
-    char* buffer = new char[br.cluster_size];
-    // Lock then seek and load directories
-    secureLoadDirs(buffer, dataStart + parent->cluster * br.cluster_size);
-    if (isClusterBad(buffer, parent->cluster))
+    prepareDir(parent, arena);
+    for (int32 part = 0; part < (int32)(parent->slots.size() / maxDirs); part++)
+        loadDirPart(parent, part, arena);
+    finishDir(parent, subdirs, arena);
+}
+
+// Read chain of dir and make empty slots for all its clusters
+void FAT::prepareDir(Node* dir, NodeArena& arena)
+{
+    // Probe already made slots of unloaded dir, entries it found stay in them
+    if (!dir->loaded && !dir->slots.empty())
+        return;
+    buildExtents(dir, arena);
+    size_t clusters = 0;
+    for (auto& extent : dir->extents)
+        clusters += extent.length;
+    dir->slots.fill(clusters*maxDirs, nullptr, arena);
+    dir->freeSlot = 0;
+}
+
+// Load one cluster of dir into its slots
+void FAT::loadDirPart(Node* dir, int32 part, NodeArena& arena)
+{
+    int32 cluster = dirCluster(dir, part);
+    // Mapped fat file can be parsed in place, otherwise take cluster from cache or load it into buffer
+    if (char* mapped = clusterData(cluster))
+        parseDir(dir, mapped, part, cluster, arena);
+    else if (cache)
+    {
+        parseDir(dir, cache->pin(cluster), part, cluster, arena);
+        cache->unpin(cluster);
+    }
+    else
     {
-        Guard g(badClustersLock);
-        badClusters.push_back(parent);
+        char* buffer = new char[br.cluster_size];
+        secureLoadDirs(buffer, clusterOffset(cluster));
+        parseDir(dir, buffer, part, cluster, arena);
+        delete[] buffer;
     }
+}
 
-    Directory* directories = new Directory[maxDirs];
-    memset(directories, 0, sizeof(Directory)*maxDirs);
-    memcpy(directories, buffer, sizeof(Directory)*maxDirs);
+// Parse dir cluster already loaded in buffer into slots of its part, parts dont share slots so they can be parsed in parallel
+void FAT::parseDir(Node* parent, char* buffer, int32 part, int32 cluster, NodeArena& arena)
+{
+    TraceSpan span("parse dir");
+    if (isClusterBad(buffer, cluster))
+    {
+        TraceSpan badSpan("bad cluster");
+        Guard g(badClustersLock, std::defer_lock);
+        Stats::lock(g, STAT_BAD_LIST_WAITS);
+        ScrubItem item = { parent, cluster, 1 };
+        badClusters.push_back(item);
+    }
 
     for (uint32 i = 0; i < maxDirs; i++)
     {
-        Directory& dir = directories[i];
+        // Cluster can start at any offset, copy entry out so its members are aligned
+        Directory dir;
+        memcpy(&dir, buffer + i*sizeof(Directory), sizeof(Directory));
         dir.name[12] = 0;
-        // If start cluester is not root
-        if (dir.start_cluster != 0)
+        // Entry pointing to root is free slot, removing leaves holes so whole cluster is read
+        if (dir.start_cluster == 0)
+            continue;
+        // Entry found by probe before dir was loaded keeps its node
+        if (parent->slots[part*maxDirs + i])
+            continue;
+        entryNode(parent, dir, part*maxDirs + i, arena);
+    }
+}
+
+// Make node of used dir entry and put it into its slot in parent
+Node* FAT::entryNode(Node* parent, Directory& entry, uint32 slot, NodeArena& arena)
+{
+    Node* child = new (arena) Node(entry.name, entry.start_cluster, entry.isFile, entry.size, parent);
+    child->slot = slot;
+    if (entry.isFile)
+        buildExtents(child, arena);
+    parent->slots[slot] = child;
+    return child;
+}
+
+// Look for name in unloaded hashed dir, clusters are read from home cluster of name until one have free slot.
+// Returns nullptr when name wasnt found, caller then loads whole dir because removes can leave holes in probe.
+Node* FAT::probeDir(Node* dir, const char* name, size_t size)
+{
+    if (size > 12)
+        return nullptr;
+    if (dir->slots.empty())
+        prepareDir(dir, *arenas[0]);
+    int32 parts = (int32)(dir->slots.size() / maxDirs);
+    int32 home = (int32)(hashName(name, size) % parts);
+    for (int32 i = 0; i < parts; i++)
+    {
+        int32 part = (home + i) % parts;
+        int32 cluster = dirCluster(dir, part);
+        Node* child = nullptr;
+        bool more;
+        if (char* mapped = clusterData(cluster))
+            more = probeCluster(dir, mapped, part, name, size, child);
+        else if (cache)
+        {
+            more = probeCluster(dir, cache->pin(cluster), part, name, size, child);
+            cache->unpin(cluster);
+        }
+        else
         {
-            Node* child = new Node(dir.name, dir.start_cluster, dir.isFile, dir.size, parent);
-            parent->addChild(child);
-            // New dir found, yay more work to do
-            if (!dir.isFile)
+            char* buffer = new char[br.cluster_size];
+            secureLoadDirs(buffer, clusterOffset(cluster));
+            more = probeCluster(dir, buffer, part, name, size, child);
+            delete[] buffer;
+        }
+        if (!more)
+            return child;
+    }
+    return nullptr;
+}
+
+// Search one cluster of probe for name, false when probe ends because name was found or cluster have free slot
+bool FAT::probeCluster(Node* dir, char* buffer, int32 part, const char* name, size_t size, Node*& child)
+{
+    // Cluster which looks bad is left to full load, it knows how to relocate it
+    if (memcmp(buffer, "FFFFFFFF", 8) == 0 && memcmp(buffer + br.cluster_size - 8, "FFFFFFFF", 8) == 0)
+        return false;
+    bool full = true;
+    for (uint32 i = 0; i < maxDirs; i++)
+    {
+        Directory entry;
+        memcpy(&entry, buffer + i*sizeof(Directory), sizeof(Directory));
+        entry.name[12] = 0;
+        if (entry.start_cluster == 0)
+        {
+            full = false;
+            continue;
+        }
+        if (strlen(entry.name) != size || memcmp(entry.name, name, size) != 0)
+            continue;
+        uint32 slot = part*maxDirs + i;
+        child = dir->slots[slot] ? dir->slots[slot] : entryNode(dir, entry, slot, *arenas[0]);
+        return false;
+    }
+    return full;
+}
+
+// All clusters of dir were parsed, add childs in slot order and return subdirs
+void FAT::finishDir(Node* dir, std::vector<Node*>& subdirs, NodeArena& arena)
+{
+    for (auto child : dir->slots)
+    {
+        if (!child)
+            continue;
+        dir->addChild(child, arena);
+        // New dir found, yay more work to do
+        if (!child->isFile)
+            subdirs.push_back(child);
+    }
+    dir->loaded = true;
+}
+
+// Load dirs and everything under them from this thread with many cluster reads in flight, false if io_uring cant be used
+bool FAT::loadDirsAsync(const std::vector<Node*>& dirs)
+{
+#ifdef HAVE_IO_URING
+    // Every read in flight have own slot with buffer, slot number is passed as user data.
+    // Buffers are declared before ring, so on exception ring waits for reads in flight before they are freed.
+    std::vector<char> buffers((size_t)ASYNC_DEPTH*br.cluster_size);
+    std::vector<iovec> vectors(ASYNC_DEPTH);
+    IoRing ring(ASYNC_DEPTH);
+    if (!ring.opened())
+        return false;
+
+    std::vector<DirPart> reading(ASYNC_DEPTH);
+    std::vector<int32> readingCluster(ASYNC_DEPTH);
+    std::vector<uint32> freeSlots;
+    for (uint32 i = 0; i < ASYNC_DEPTH; i++)
+    {
+        vectors[i].iov_base = &buffers[(size_t)i*br.cluster_size];
+        vectors[i].iov_len = br.cluster_size;
+        freeSlots.push_back(i);
+    }
+
+    NodeArena& arena = *arenas[0];
+    std::deque<DirPart> waiting;
+    for (auto dir : dirs)
+    {
+        DirPart work = { dir, -1, nullptr };
+        waiting.push_back(work);
+    }
+    std::vector<Node*> subdirs;
+    uint32 inFlight = 0;
+    while (!waiting.empty() || inFlight)
+    {
+        while (!waiting.empty() && !freeSlots.empty())
+        {
+            // Dir is split into its clusters when it gets to front, they are read in parallel as any other work
+            if (waiting.front().part < 0)
             {
+                Node* dir = waiting.front().node;
+                waiting.pop_front();
+                prepareDir(dir, arena);
+                int32 parts = (int32)(dir->slots.size() / maxDirs);
+                if (!parts)
+                {
+                    finishDir(dir, subdirs, arena);
+                    continue;
+                }
+                std::atomic<int32>* remaining = new (arena.allocate(sizeof(std::atomic<int32>))) std::atomic<int32>(parts);
+                for (int32 i = parts - 1; i >= 0; i--)
                 {
-                    // Critical section lock
-                    Guard guard(dirsLock);
-                    dirs++;
-                    dirsToLoad.push_back(child);
+                    DirPart part = { dir, i, remaining };
+                    waiting.push_front(part);
                 }
-                // Wake one consumer
-                condition.notify_one();
+                continue;
+            }
+
+            uint32 slot = freeSlots.back();
+            int32 cluster = dirCluster(waiting.front().node, waiting.front().part);
+            if (!ring.read(image->descriptor(), &vectors[slot], clusterOffset(cluster), slot))
+                break;
+            freeSlots.pop_back();
+            reading[slot] = waiting.front();
+            readingCluster[slot] = cluster;
+            waiting.pop_front();
+            inFlight++;
+        }
+        // Only dirs without clusters were left
+        if (!inFlight)
+            continue;
 
+        uint64 start = Trace::now();
+        int res = ring.submit(1);
+        Trace::span("submit", start);
+        if (res < 0 && res != -EAGAIN && res != -EBUSY)
+            throw std::runtime_error("Error while loading dirs!");
+
+        // Parse every finished cluster and queue dirs found in it right away
+        uint64 slot;
+        int32 result;
+        while (ring.complete(slot, result))
+        {
+            char* buffer = (char*)vectors[slot].iov_base;
+            DirPart& work = reading[slot];
+            int32 cluster = readingCluster[slot];
+            if (result < 0)
+                secureLoadDirs(buffer, clusterOffset(cluster));
+            else
+            {
+                Stats::add(STAT_DIR_READS);
+                Stats::add(STAT_DIR_READ_BYTES, result);
+                if (result < br.cluster_size)
+                    memset(buffer + result, 0, br.cluster_size - result);
             }
+
+            parseDir(work.node, buffer, work.part, cluster, arena);
+            // Last cluster of dir finishes it and queues its subdirs
+            if (--*work.remaining == 0)
+            {
+                subdirs.clear();
+                finishDir(work.node, subdirs, arena);
+                Stats::add(STAT_DIRS_LOADED);
+                for (auto dir : subdirs)
+                {
+                    DirPart next = { dir, -1, nullptr };
+                    waiting.push_back(next);
+                }
+            }
+            freeSlots.push_back((uint32)slot);
+            inFlight--;
         }
-        // Otherwise assume everything is fine and we just got to end of dir list filled with zeros
-        else
-            break;
     }
-    delete[] directories;
-    delete[] buffer;
-
-    // If noone is working that mean all work is done, its time wake everyone and have a party, lets hope everyone joins
-    if (--working == 0)
-        condition.notify_all();
+    return true;
+#else
+    return false;
+#endif
 }
 
 FAT::~FAT()
 {
-    fclose(file);
+    TraceSpan span("close");
+    if (cache)
+    {
+        // Dirty clusters of failed command would be written directly without cache too
+        try
+        {
+            cache->flush();
+        }
+        catch (std::exception&)
+        {
+        }
+    }
+
+    if (journal)
+    {
+        // Committed changes are already in place, just make journal empty
+        try
+        {
+            journal->checkpoint();
+        }
+        catch (std::exception&)
+        {
+        }
+    }
+    release();
+}
+
+// Free memory and close fat file, nothing is written
+void FAT::release()
+{
+    delete cache;
+    cache = nullptr;
+    delete journal;
+    journal = nullptr;
+
+    if (image)
+        delete image;
+    image = nullptr;
 
     if (fatTables)
     {
-        for (uint8 i = 0; i < br.fat_copies; i++)
+        // Mapped tables are owned by mapping
+        for (uint8 i = 0; i < loadedCopies && !use_mmap; i++)
             if (fatTables[i])
                 delete[] fatTables[i];
         delete[] fatTables;
+        fatTables = nullptr;
     }
 
-    if (root)
-        delete root;
-
+    // Whole tree is freed with its arenas
+    for (auto arena : arenas)
+        delete arena;
+    arenas.clear();
 }
 
 // Add file into FAT if exist and path to dir exists
 void FAT::addFile(std::string filename, std::string fatDir)
 {
-    // Remove first / since our root have empty name
-    if (fatDir[0] == '/')
-        fatDir = fatDir.substr(1);
-
-    // Dont need to / on end of path
-    if (fatDir[fatDir.length() - 1] == '/')
-        fatDir = fatDir.substr(0, fatDir.length() - 1);
     // Try to find node according to specified path
     Node* node = find(root, fatDir);
     if (!node || node->isFile)
         throw std::runtime_error("Path not found");
-    if (Node* existing = find(node, filename))
+    // Name in fat is name of file without its path on disk
+    std::string name = filename;
+    extractFilename(name);
+    if (Node* existing = find(node, name))
         throw std::runtime_error("File/Dir with same name already in path");
 
     // Open new file
-    FILE* newFile= fopen(filename.c_str(), "rb");
-    if (!newFile)
+    ImageIO source(filename, true);
+    if (!source.opened())
         throw std::runtime_error("Cant open new file!");
 
-    // Calculate size of new file
-    fseek(newFile, 0L, SEEK_END);
-    uint32 size = ftell(newFile);
-    // Seet back to befining
-    fseek(newFile, 0L, SEEK_SET);
+    // Size of file is saved in directory as int32
+    uint64 size = source.size();
+    if (size > INT32_MAX)
+        throw std::runtime_error("File is too big");
     // Calculate number of clusters we need for new file
-    uint32 nrCluster = size / br.cluster_size + !!(size % br.cluster_size);
+    uint32 nrCluster = (uint32)(size / br.cluster_size + !!(size % br.cluster_size));
 
-    std::vector<int32> clusters;
-    // Find free clusters in fat
-    findFreeClusters(clusters, nrCluster);
-    // Check if there is enough space for file
-    if (clusters.size() != nrCluster)
-    {
-        fclose(newFile);
+    // Even empty file needs its start cluster
+    nrCluster = std::max(nrCluster, (uint32)1);
+    // Full dir grows only when file is written and nothing can fail, its clusters must be left for it
+    ensureLoaded(node);
+    uint32 growCluster = growClusters(node);
+
+    std::vector<Extent> extents;
+    // Find free clusters in fat, as runs of consecutive clusters
+    if ((uint32)freeClusters.freeClusters() < nrCluster + growCluster || !findFreeClusters(extents, nrCluster))
         throw std::runtime_error("Not enough disc space");
-    }
 
-    // Copy files into clusters
-    char* buffer = new char[br.cluster_size];     
-    for (uint32 i = 0; i < clusters.size(); i++)
-    {
-        memset(buffer, 0, br.cluster_size);
-        // Read cluster from new file
-        size_t res = fread(buffer, br.cluster_size, 1, newFile);
-        // Seek to cluster
-        fseek(file, dataStart + clusters[i]*(br.cluster_size), SEEK_SET);
-        // Write buffer to fat
-        fwrite(buffer, br.cluster_size, 1, file);
+    // Mapped file can be written straight from mapping, otherwise it is read in big chunks
+    const char* mapped = source.map() ? source.data() : nullptr;
+    std::vector<char> chunk(mapped ? 0 : std::max((uint32)IMPORT_CHUNK / br.cluster_size, (uint32)1) * br.cluster_size);
+    std::vector<char> zeros(br.cluster_size, 0);
 
-        // Update FAT
-        for (uint8 j = 0; j < br.fat_copies; j++)
-            fatTables[j][clusters[i]] = (i == clusters.size() - 1 ? FAT_FILE_END: clusters[i+1]);
+    // Copy file into runs of clusters, every part is written by one vectored write
+    uint64 position = 0;
+    for (auto& extent : extents)
+    {
+        // Old content of free clusters in cache must not be written over file later
+        if (cache)
+            cache->discard(extent);
+        uint64 offset = clusterOffset(extent.start);
+        uint64 extentEnd = position + (uint64)extent.length*br.cluster_size;
+        while (position < extentEnd)
+        {
+            uint64 part = mapped ? extentEnd - position : std::min<uint64>(extentEnd - position, chunk.size());
+            size_t dataSize = (size_t)(position < size ? std::min<uint64>(part, size - position) : 0);
+            if (!mapped && source.read(chunk.data(), dataSize, position) != dataSize)
+                throw std::runtime_error("Cant read new file!");
+
+            IoBuffer buffers[2];
+            buffers[0].data = mapped ? mapped + position : chunk.data();
+            buffers[0].size = dataSize;
+            // Rest of last cluster is filled with zeros
+            buffers[1].data = zeros.data();
+            buffers[1].size = (size_t)(part - dataSize);
+            if (image->write(buffers, 2, offset) != part)
+                throw std::runtime_error("Cant write file into fat!");
+
+            position += part;
+            offset += part;
+        }
     }
 
-    extractFilename(filename);
-    // Push new file into filesystem
-    node->childs.push_back(new Node(filename, clusters.front(), true, size, node));
+    // Update FAT and push new file into filesystem
+    setChain(extents);
+    Node* file = new (*arenas[0]) Node(name.c_str(), extents.front().start, true, (int32)size, node);
+    file->extents.assign(extents.data(), extents.size(), *arenas[0]);
+    freeSlot(node, file->name);
     updateFatTables();
-    updateCluster(node);
-
-    delete[] buffer;
-    fclose(newFile);
+    addEntry(node, file);
     std::cout << "OK" << std::endl;
 }
 
 // Create dir in parentDir
 void FAT::createDir(std::string dir, std::string parentDir)
 {
-    // Remove first / since our root have empty name
-    if (parentDir[0] == '/')
-        parentDir = parentDir.substr(1);
-
     // Dont save / on end of the name
     if (dir[dir.length() - 1] == '/')
         dir = dir.substr(0, dir.length() - 1);
-    // Dont need to / on end of path
-    if (parentDir[parentDir.length() - 1] == '/')
-        parentDir = parentDir.substr(0, parentDir.length() - 1);
 
     // Try to find node according to specified path
-    Node* node = parentDir.empty() ? root : find(root, parentDir);
+    Node* node = find(root, parentDir);
     if (!node || node->isFile)
-        std::cout << "Path not found" << std::endl;
+        throw std::runtime_error("Path not found");
     else if (Node* existing = find(node, dir))
-        std::cout << "File/Dir with same name already in path" << std::endl;
+        throw std::runtime_error("File/Dir with same name already in path");
     else
     {
-        // Find a free cluster
+        // Find a free cluster, full parent needs more to grow
+        ensureLoaded(node);
         int32 cluster = findFreeCluster();
-        if (cluster == -1)
+        if (cluster == -1 || (uint32)freeClusters.freeClusters() < 1 + growClusters(node))
             throw std::runtime_error("Not enough disc space");
         // Add new dir into FS
-        node->childs.push_back(new Node(dir, cluster, false, 0, node));
-        // Update FAT
-        for (uint8 i = 0; i < br.fat_copies; i++)
-            fatTables[i][cluster] = FAT_DIRECTORY;
+        Node* child = new (*arenas[0]) Node(dir.c_str(), cluster, false, 0, node);
+        // Update FAT, parent grows after new dir took its cluster
+        setCluster(cluster, FAT_DIRECTORY);
+        freeSlot(node, child->name);
+        // Fresh dir is empty, nothing to load from disk
+        prepareDir(child, *arenas[0]);
+        child->loaded = true;
         updateFatTables();
-        updateCluster(node);
+        addEntry(node, child);
         std::cout << "OK" << std::endl;
     }
 }
 
-// Update FAT tables into file
+// Update FAT tables into file, deferred until sync when batching writes
 void FAT::updateFatTables()
 {
-    // Seek to fat section
-    fseek(file, sizeof(BootRecord), SEEK_SET);
-    //
+    if (!deferWrites)
+        writeFatTables();
+}
+
+// Write changed parts of FAT tables into file
+void FAT::writeFatTables()
+{
+    // Fat section starts after boot record
+    size_t tableSize = sizeof(int32)*br.usable_cluster_count;
     for (uint8 i = 0; i < br.fat_copies; i++)
     {
-        size_t res =fwrite(fatTables[i], sizeof(int32), br.usable_cluster_count, file);
-        if (res != br.usable_cluster_count)
-            throw std::runtime_error("Cant update fat tables!");
+        // Copies which are not loaded are written from changes of primary
+        uint8 source = i < loadedCopies ? i : 0;
+        for (auto range = dirtyFat[source].begin(); range != dirtyFat[source].end(); ++range)
+        {
+            size_t size = sizeof(int32)*(range->second - range->first);
+            uint64 offset = sizeof(BootRecord) + (uint64)i*tableSize + sizeof(int32)*range->first;
+            Stats::add(STAT_FAT_WRITES);
+            Stats::add(STAT_FAT_WRITE_BYTES, size);
+            // Mapped tables are already changed in file
+            if (image->data())
+            {
+                if (source != i)
+                    memcpy(image->data() + offset, fatTables[source] + range->first, size);
+                continue;
+            }
+            writeMetadata(JOURNAL_FAT, fatTables[source] + range->first, size, offset);
+        }
+    }
+    for (auto& ranges : dirtyFat)
+        ranges.clear();
+}
+
+// Fill run of clusters with zeros, written in big pieces instead of cluster by cluster
+void FAT::clearClusters(const Extent& extent)
+{
+    if (cache)
+        cache->discard(extent);
+    uint64 size = (uint64)extent.length*br.cluster_size;
+    std::vector<char> zeros((size_t)std::min<uint64>(size, IMPORT_CHUNK), 0);
+    for (uint64 done = 0; done < size; )
+    {
+        size_t part = (size_t)std::min<uint64>(size - done, zeros.size());
+        if (image->write(zeros.data(), part, clusterOffset(extent.start) + done) != part)
+            throw std::runtime_error("Cant clean cluster!");
+        Stats::add(STAT_CLEAR_WRITES);
+        Stats::add(STAT_CLEAR_BYTES, part);
+        done += part;
     }
 }
 
 // File cluster with zeros
 void FAT::clearCluster(int32 cluster)
 {
+    Stats::add(STAT_CLEAR_WRITES);
+    Stats::add(STAT_CLEAR_BYTES, br.cluster_size);
+    if (cache)
+    {
+        memset(cache->pin(cluster, false), 0, br.cluster_size);
+        cache->unpin(cluster, true);
+        return;
+    }
     char* buffer = new char[br.cluster_size];
     memset(buffer, 0, br.cluster_size);
-    fseek(file, dataStart + cluster*(br.cluster_size), SEEK_SET);
-    size_t res = fwrite(buffer, br.cluster_size, 1, file);
+    size_t res = image->write(buffer, br.cluster_size, clusterOffset(cluster));
     delete[] buffer;
-    if (!res)
+    if (res != br.cluster_size)
         throw std::runtime_error("Cant clean cluster!");
 }
 
-// Update cluster into file
-void FAT::updateCluster(Node* node)
+// Cluster of dir chain holding given part of its slots
+int32 FAT::dirCluster(Node* dir, int32 part)
+{
+    for (auto& extent : dir->extents)
+    {
+        if (part < extent.length)
+            return extent.start + part;
+        part -= extent.length;
+    }
+    throw std::runtime_error("Corrupted FAT!");
+}
+
+// Free slot for name in dir, chain grows first when dir is full.
+// Linear dir takes lowest free slot, hashed dir is rehashed after growing and takes first free slot from home cluster of name.
+uint32 FAT::freeSlot(Node* dir, const char* name)
+{
+    if (uint32 clusters = growClusters(dir))
+    {
+        growDir(dir, clusters);
+        if (hashed_dirs)
+            layoutDir(dir);
+    }
+    if (hashed_dirs)
+        return hashedSlot(dir, name);
+    hasFreeSlot(dir);
+    return dir->freeSlot;
+}
+
+// Number of clusters dir grows by when one more entry is added, hashed dir doubles when it would be over 3/4 full
+uint32 FAT::growClusters(Node* dir)
+{
+    if (!hashed_dirs)
+        return hasFreeSlot(dir) ? 0 : 1;
+    if ((dir->childs.size() + 1) * 4 <= dir->slots.size() * 3)
+        return 0;
+    return (uint32)(dir->slots.size() / maxDirs);
+}
+
+// Add clusters on end of dir chain, slots of them are free
+void FAT::growDir(Node* dir, uint32 clusters)
+{
+    for (uint32 c = 0; c < clusters; c++)
+    {
+        int32 cluster = findFreeCluster();
+        if (cluster == -1)
+            throw std::runtime_error("Not enough disc space");
+        Extent& last = dir->extents[dir->extents.size() - 1];
+        int32 end = last.start + last.length;
+        // New cluster becomes end of chain
+        setCluster(end - 1, cluster);
+        setCluster(cluster, FAT_DIRECTORY);
+        if (cluster == end)
+            last.length++;
+        else
+        {
+            Extent extent = { cluster, 1 };
+            dir->extents.push_back(extent, *arenas[0]);
+        }
+        for (uint32 i = 0; i < maxDirs; i++)
+            dir->slots.push_back(nullptr, *arenas[0]);
+    }
+}
+
+// First free slot probing clusters from home cluster of name, same order as probeDir reads them
+uint32 FAT::hashedSlot(Node* dir, const char* name)
+{
+    uint32 parts = (uint32)(dir->slots.size() / maxDirs);
+    uint32 home = hashName(name, strnlen(name, 12)) % parts;
+    for (uint32 i = 0; i < parts; i++)
+    {
+        uint32 part = (home + i) % parts;
+        for (uint32 slot = part*maxDirs; slot < (part + 1)*maxDirs; slot++)
+            if (!dir->slots[slot])
+                return slot;
+    }
+    throw std::runtime_error("Corrupted FAT!");
+}
+
+// True if dir have free slot, so adding entry wont grow its chain
+bool FAT::hasFreeSlot(Node* dir)
+{
+    uint32 slot = dir->freeSlot;
+    while (slot < dir->slots.size() && dir->slots[slot])
+        slot++;
+    dir->freeSlot = slot;
+    return slot < dir->slots.size();
+}
+
+// Put child into free slot of dir, only cluster with that slot is written
+void FAT::addEntry(Node* dir, Node* child)
+{
+    ensureLoaded(dir);
+    uint32 slot = freeSlot(dir, child->name);
+    dir->slots[slot] = child;
+    dir->freeSlot = slot + 1;
+    child->slot = slot;
+    dir->addChild(child, *arenas[0]);
+    updateCluster(dir, slot / maxDirs);
+}
+
+// Take child out of its dir, its slot becomes free
+void FAT::removeEntry(Node* child)
+{
+    Node* dir = child->parent;
+    // Node found by probe is in slots, but parent must be loaded to know all its childs
+    ensureLoaded(dir);
+    dir->slots[child->slot] = nullptr;
+    dir->freeSlot = std::min(dir->freeSlot, (uint32)child->slot);
+    dir->removeChild(child);
+    updateCluster(dir, child->slot / maxDirs);
+    child->slot = -1;
+    // Clusters of removed dir must not be written anymore
+    dirtyDirs.erase(dirtyDirs.lower_bound(std::make_pair(child, 0)), dirtyDirs.upper_bound(std::make_pair(child, INT32_MAX)));
+}
+
+// Entry of child changed, write cluster of parent where it is
+void FAT::updateEntry(Node* child)
+{
+    if (!child->parent)
+        return;
+    ensureLoaded(child->parent);
+    updateCluster(child->parent, child->slot / maxDirs);
+}
+
+// Give all childs slots again in their order, used when chain of dir was cut
+void FAT::layoutDir(Node* dir)
+{
+    prepareDir(dir, *arenas[0]);
+    // Hashed dir must stay at most 3/4 full so probes end
+    while (hashed_dirs && dir->childs.size() * 4 > dir->slots.size() * 3)
+        growDir(dir, (uint32)(dir->slots.size() / maxDirs));
+    for (auto child : dir->childs)
+    {
+        uint32 slot = hashed_dirs ? hashedSlot(dir, child->name) : freeSlot(dir, child->name);
+        dir->slots[slot] = child;
+        child->slot = slot;
+    }
+    dir->freeSlot = 0;
+    for (int32 part = 0; part < (int32)(dir->slots.size() / maxDirs); part++)
+        updateCluster(dir, part);
+}
+
+// Update dir cluster into file, deferred until sync when batching writes
+void FAT::updateCluster(Node* dir, int32 part)
+{
+    if (deferWrites)
+        dirtyDirs.insert(std::make_pair(dir, part));
+    else
+        writeCluster(dir, part);
+}
+
+// Write slots of one dir cluster
+void FAT::writeCluster(Node* dir, int32 part)
+{
+    // Build whole cluster with free slots cleared and write it at once
+    std::vector<char> buffer(br.cluster_size, 0);
+    for (uint32 i = 0; i < maxDirs; i++)
+    {
+        Node* n = dir->slots[part*maxDirs + i];
+        if (!n)
+            continue;
+        Directory entry;
+        memset(&entry, 0, sizeof(Directory));
+        entry.isFile = n->isFile;
+        strncpy(entry.name, n->name, 12);
+        entry.size = n->size;
+        entry.start_cluster = n->cluster;
+        memcpy(&buffer[i*sizeof(Directory)], &entry, sizeof(Directory));
+    }
+    int32 cluster = dirCluster(dir, part);
+    Stats::add(STAT_DIR_WRITES);
+    Stats::add(STAT_DIR_WRITE_BYTES, buffer.size());
+    // Cached copy is written through, so metadata keeps its ordering with journal
+    if (cache)
+    {
+        memcpy(cache->pin(cluster, false), buffer.data(), buffer.size());
+        // Journal writes cluster in place only on commit, until then disk have stale copy which must not be loaded
+        if (journal)
+            journalPins.push_back(cluster);
+        else
+            cache->unpin(cluster);
+    }
+    writeMetadata(JOURNAL_DIR, buffer.data(), buffer.size(), clusterOffset(cluster));
+}
+
+// Write fat tables or dir cluster, with journal it becomes part of transaction committed on sync
+void FAT::writeMetadata(uint32 type, const void* data, size_t size, uint64 offset)
+{
+    if (journal)
+        journal->add(type, data, size, offset);
+    else if (image->write(data, size, offset) != size)
+        throw std::runtime_error(type == JOURNAL_FAT ? "Cant update fat tables!" : "Cant update cluster!");
+}
+
+// Free all clusters of runs from fat tables
+void FAT::removeFromFatTables(const std::vector<Extent>& extents)
+{
+    for (auto& extent : extents)
+    {
+        // Dropped or unfinished transaction must find old content, so with journal clusters are cleared after commit
+        if (journal)
+            journalFreed.push_back(extent);
+        else
+            clearClusters(extent);
+        for (int32 cluster = extent.start; cluster < extent.start + extent.length; cluster++)
+        {
+            setCluster(cluster, FAT_UNUSED);
+            // Keep it used in index, new file written into it would overwrite content before commit
+            if (journal)
+                freeClusters.update(cluster, FAT_UNUSED, FAT_FILE_END);
+        }
+    }
+}
+
+// Build runs of consecutive clusters from chain of file or dir
+void FAT::buildExtents(Node* node, NodeArena& arena)
+{
+    int32 loop = walkChain(node, arena, br.usable_cluster_count);
+    if (!loop)
+        return;
+    // Looping chain is cut before first cluster visited second time, check reports it and repair ends it there
+    const int32* fat = fatTables[0];
+    int32 ahead = node->cluster;
+    for (int32 i = 0; i < loop; i++)
+        ahead = fat[ahead];
+    int32 cluster = node->cluster;
+    int32 start = 0;
+    for (; cluster != ahead; start++)
+    {
+        cluster = fat[cluster];
+        ahead = fat[ahead];
+    }
+    walkChain(node, arena, start + loop);
+}
+
+// Build extents from at most limit clusters of chain, stops on broken link.
+// Returns length of loop if chain comes back to cluster it already visited, otherwise zero.
+int32 FAT::walkChain(Node* node, NodeArena& arena, int32 limit)
+{
+    const int32* fat = fatTables[0];
+    int32 count = br.usable_cluster_count;
+    node->extents.clear();
+    // Brent's loop detection, saved cluster jumps forward after every power of two steps
+    int32 saved = node->cluster;
+    int64_t power = 1;
+    int32 distance = 1;
+    int32 cluster = node->cluster;
+    for (int32 steps = 0; steps < limit && cluster >= 0 && cluster < count; steps++)
+    {
+        size_t size = node->extents.size();
+        if (size && node->extents[size - 1].start + node->extents[size - 1].length == cluster)
+            node->extents[size - 1].length++;
+        else
+        {
+            Extent extent = { cluster, 1 };
+            node->extents.push_back(extent, arena);
+        }
+        int32 next = fat[cluster];
+        if (next == saved)
+            return distance;
+        if (distance == power)
+        {
+            saved = next;
+            power *= 2;
+            distance = 0;
+        }
+        distance++;
+        cluster = next;
+    }
+    return 0;
+}
+
+// Set fat entry in every copy and keep free cluster index in sync
+void FAT::setCluster(int32 cluster, int32 value)
 {
-    // Clear cluster
-    clearCluster(node->cluster);
-    fseek(file, dataStart + node->cluster*(br.cluster_size), SEEK_SET);
-    // Write directories
-    for (auto n : node->childs)
+    freeClusters.update(cluster, fatTables[0][cluster], value);
+    for (uint8 i = 0; i < loadedCopies; i++)
     {
-        Directory dir;
-        dir.isFile = n->isFile;
-        memset(dir.name, 0, 13);
-        strncpy(dir.name, n->name.c_str(),12);
-        dir.size = n->size;
-        dir.start_cluster = n->cluster;         
-   
-        size_t res = fwrite(&dir, sizeof(Directory), 1, file);
-        if (!res)
-            throw std::runtime_error("Cant update cluster!");
+        fatTables[i][cluster] = value;
+        dirtyFat[i].add(cluster, cluster + 1);
     }
 }
 
-// Free all clusters from fat tables
-void FAT::removeFromFatTables(int32 cluster, uint8 tableIndex, clusterTypes last)
+// Link runs of clusters into one chain ended by FAT_FILE_END, every copy is updated in one pass
+void FAT::setChain(const std::vector<Extent>& extents)
 {
-    if (fatTables[tableIndex][cluster] != last)
-        removeFromFatTables(fatTables[tableIndex][cluster], tableIndex, last);
+    for (auto& extent : extents)
+        for (int32 cluster = extent.start; cluster < extent.start + extent.length; cluster++)
+            freeClusters.update(cluster, fatTables[0][cluster], 0);
 
-    if (tableIndex == 0)
-        clearCluster(cluster);
-
-    fatTables[tableIndex][cluster] = FAT_UNUSED;
+    for (uint8 i = 0; i < loadedCopies; i++)
+    {
+        int32* table = fatTables[i];
+        for (size_t j = 0; j < extents.size(); j++)
+        {
+            int32 end = extents[j].start + extents[j].length - 1;
+            for (int32 cluster = extents[j].start; cluster < end; cluster++)
+                table[cluster] = cluster + 1;
+            // Last cluster of run continues with next run
+            table[end] = j + 1 == extents.size() ? FAT_FILE_END : extents[j + 1].start;
+            dirtyFat[i].add(extents[j].start, end + 1);
+        }
+    }
 }
 
 // Find free cluster, return -1 if there is not one
 int32 FAT::findFreeCluster()
 {
-    for (int32 i = 1; i < br.usable_cluster_count; i++)
-        if (fatTables[0][i] == FAT_UNUSED)
-            return i;
-    return -1;
+    // Cluster 0 belongs to root
+    return freeClusters.findFree(1);
 }
 
-// Find free number clusters 
-void FAT::findFreeClusters(std::vector<int32>& clusters, int32 nrCluster)
+// Find nrCluster free clusters as runs of consecutive clusters, false if there is not enough of them
+bool FAT::findFreeClusters(std::vector<Extent>& extents, int32 nrCluster)
 {
-    for (int32 i = 1; i < br.usable_cluster_count; i++)
-    {
-        if (fatTables[0][i] == FAT_UNUSED)
-            clusters.push_back(i);
-        if (clusters.size() == nrCluster)
-            break;
-    }
+    return freeClusters.findFreeExtents(extents, 1, nrCluster);
 }
 
 // Remove file or directory
 void FAT::remove(std::string name, clusterTypes type)
 {
-    // Remove first / since our root have empty name
-    if (name[0] == '/')
-        name = name.substr(1);
-
-    // Dont need to / on end of path
-    if (type == FAT_DIRECTORY && name[name.length() - 1] == '/')
-        name = name.substr(0, name.length() - 1);
-
     // Try to find file/dir to remove
     Node* node = find(root, name);
+    if (node)
+        ensureLoaded(node);
     // Validate
-    if (!node || (type == FAT_DIRECTORY && node->isFile) || (type == FAT_FILE_END && !node->isFile))
-        std::cout << "Path not found" << std::endl;
+    if (!node || !node->parent || (type == FAT_DIRECTORY && node->isFile) || (type == FAT_FILE_END && !node->isFile))
+        throw std::runtime_error("Path not found");
     else if (!node->childs.empty())
-        std::cout << "Not empty" << std::endl;
+        throw std::runtime_error("Not empty");
     else
     {
         // Free all clusters owned by file/dir
-        for (uint8 i = 0; i < br.fat_copies; i++)
-            removeFromFatTables(node->cluster, i, type);
+        removeFromFatTables(std::vector<Extent>(node->extents.begin(), node->extents.end()));
 
         // Sync fat tables into file
         updateFatTables();
-        Node* parent = node->parent;
-        if (parent)
-        {
-            // Remove file/dir from parent
-            auto itr = std::find(parent->childs.begin(), parent->childs.end(), node);
-            if (itr != parent->childs.end())
-                parent->childs.erase(itr);
-        }
-        // Update parent
-        updateCluster(parent);
-        delete node;
+        // Remove file/dir from parent and free its slot
+        removeEntry(node);
         std::cout << "OK" << std::endl;
     }
 }
 
-// Print all clusters of file
-void FAT::printFileClusters(std::string fileName)
+// Defer fat tables and dir clusters writes until sync, so many operations can be done with one write
+void FAT::setDeferred(bool deferred)
+{
+    if (!deferred)
+        sync();
+    // Journal commits only on sync
+    deferWrites = deferred || journal;
+}
+
+// Write all deferred dir clusters and fat tables
+void FAT::sync()
+{
+    TraceSpan span("sync");
+    for (auto& part : dirtyDirs)
+        writeCluster(part.first, part.second);
+    dirtyDirs.clear();
+    writeFatTables();
+    // Data clusters must be written before journal commits metadata pointing to them
+    if (cache)
+        cache->flush();
+    // All changes since last sync become one transaction
+    if (journal)
+        journal->commit();
+    for (auto cluster : journalPins)
+        cache->unpin(cluster);
+    journalPins.clear();
+    // Freed clusters are free on disk now, they can be cleared and taken again
+    for (auto& extent : journalFreed)
+    {
+        clearClusters(extent);
+        for (int32 cluster = extent.start; cluster < extent.start + extent.length; cluster++)
+            freeClusters.update(cluster, FAT_FILE_END, FAT_UNUSED);
+    }
+    journalFreed.clear();
+}
+
+// Drop deferred changes and open transaction of failed command. Tree and tables in memory dont match disk anymore,
+// so nothing may be written from this fat after it.
+void FAT::abort()
 {
-    // Remove first / since our root have empty name
-    if (fileName[0] == '/')
-        fileName = fileName.substr(1);
+    dirtyDirs.clear();
+    for (auto& ranges : dirtyFat)
+        ranges.clear();
+    if (journal)
+        journal->abort();
+    for (auto cluster : journalPins)
+        cache->unpin(cluster);
+    journalPins.clear();
+    // Transaction which freed them is gone, old content stays
+    journalFreed.clear();
+}
 
+// Print all clusters of file, or runs of consecutive clusters as first-last
+void FAT::printFileClusters(std::string fileName, bool ranges)
+{
     Node* node = find(root, fileName);
     if (!node || !node->isFile)
-        std::cout << "Path not found" << std::endl;
+        throw std::runtime_error("Path not found");
     else
     {
         std::cout << node->name << " ";
-        int32 cluster = node->cluster;
-        do
+        for (auto& extent : node->extents)
         {
-            std::cout << cluster << " ";
-            cluster = fatTables[0][cluster];
-        } while (cluster != FAT_FILE_END);
+            if (ranges)
+            {
+                std::cout << extent.start;
+                if (extent.length > 1)
+                    std::cout << "-" << extent.start + extent.length - 1;
+                std::cout << " ";
+            }
+            else
+                for (int32 cluster = extent.start; cluster < extent.start + extent.length; cluster++)
+                    std::cout << cluster << " ";
+        }
         std::cout << std::endl;
     }
 }
@@ -446,13 +1363,9 @@ void FAT::printFileClusters(std::string fileName)
 // Print contents of file
 void FAT::printFile(std::string fileName)
 {
-    // Try to find file/dir to remove
-    if (fileName[0] == '/')
-        fileName = fileName.substr(1);
-
     Node* file = find(root, fileName);
     if (!file || !file->isFile)
-        std::cout << "Path not found" << std::endl;
+        throw std::runtime_error("Path not found");
     else
     {
         //std::cout << file->name << " ";
@@ -461,75 +1374,113 @@ void FAT::printFile(std::string fileName)
     }
 }
 
-// Print cluster content, check for bad cluster and try to fix it
-void FAT::_printFile(Node* node)
+// Write exact content of file into host file or stdout, consecutive clusters are copied by one call
+void FAT::exportFile(std::string fileName, std::string hostFile)
 {
-    int32 cluster = node->cluster;
-    int32 prevCluster = -1;
-    char* buffer = new char[br.cluster_size+1];
-    do
+    Node* node = find(root, fileName);
+    if (!node || !node->isFile)
+        throw std::runtime_error("Path not found");
+
+    bool toStdout = hostFile.empty() || hostFile == "-";
+    int outFd = toStdout ? 1 : ImageIO::createFile(hostFile);
+    if (outFd < 0)
+        throw std::runtime_error("Cant open output file!");
+    // Dont mix buffered output with output written directly into descriptor
+    std::cout.flush();
+    // Kernel copies straight from file, it must see cached changes
+    if (cache)
+        cache->flush();
+
+    uint64 remaining = node->size;
+    for (size_t i = 0; i < node->extents.size() && remaining; i++)
     {
-        memset(buffer, 0, br.cluster_size + 1);
-        fseek(file, dataStart + cluster*(br.cluster_size), SEEK_SET);
-        size_t res = fread(buffer, sizeof(char), br.cluster_size, file);
-        if (res != br.cluster_size)
+        const Extent& extent = node->extents[i];
+        // Let kernel read next run while this one is copied
+        if (i + 1 < node->extents.size())
+            image->prefetch(clusterOffset(node->extents[i + 1].start), (uint64)node->extents[i + 1].length*br.cluster_size);
+        uint64 size = std::min(remaining, (uint64)extent.length*br.cluster_size);
+        if (image->copyTo(outFd, clusterOffset(extent.start), size) != size)
         {
-            delete[] buffer;
+            if (!toStdout)
+                ImageIO::closeFile(outFd);
             throw std::runtime_error("Failed read of cluster!");
         }
+        remaining -= size;
+    }
+    // Chain ended before all data of file
+    if (remaining)
+    {
+        if (!toStdout)
+            ImageIO::closeFile(outFd);
+        throw std::runtime_error("Corrupted FAT!");
+    }
+
+    if (!toStdout)
+    {
+        ImageIO::closeFile(outFd);
+        std::cout << "OK" << std::endl;
+    }
+}
+
+// Print cluster content, check for bad cluster and try to fix it
+void FAT::_printFile(Node* node)
+{
+    int32 prevCluster = -1;
+    bool relocated = false;
+    // Last cluster is only partially used, print only bytes which belongs to file
+    uint32 remaining = node->size;
+    // Chain changes when bad cluster is relocated, walk copy of its runs
+    std::vector<Extent> extents(node->extents.begin(), node->extents.end());
+    // Mapped file is printed in place, otherwise clusters are read ahead in background
+    Readahead reader(image, cache, extents, dataStart, br.cluster_size);
+    int32 cluster;
+    while (char* buffer = reader.next(cluster))
+    {
+        uint32 bytes = std::min(remaining, (uint32)br.cluster_size);
+        remaining -= bytes;
 
         if (isClusterBad(buffer, cluster))
         {
             std::cout << std::endl << "Relocating bad cluster!" << std::endl;
             int32 newCluster = findFreeCluster();
-            if (cluster == -1)
+            if (newCluster == -1)
                 throw std::runtime_error("Not enough room for realocate bad cluster!");
-            if (prevCluster == -1)
-            {
-                node->cluster = newCluster;
-                if (node->parent)
-                    updateCluster(node->parent);
-            }
-            for (uint8 i = 0; i < br.fat_copies; i++)
-            {
-                fatTables[i][newCluster] = fatTables[i][cluster];
-                if (prevCluster != -1)
-                    fatTables[i][prevCluster] = newCluster;
-            }
-            moveCluster(cluster, newCluster);
+            // Print before cluster is moved, moving clears old cluster
+            std::cout.write(buffer, bytes);
+            relocated = true;
+            relocateCluster(node, prevCluster, cluster, newCluster);
             prevCluster = newCluster;
-            fatTables[0][cluster] = FAT_BAD_CLUSTER;
-            cluster = fatTables[0][newCluster];
             updateFatTables();
-            std::cout << buffer;
             continue;
         }
-        std::cout << buffer;
+        std::cout.write(buffer, bytes);
         prevCluster = cluster;
-        cluster = fatTables[0][cluster];
-    } while (cluster != FAT_FILE_END);
-    delete[] buffer;
+    }
+    if (relocated)
+        buildExtents(node, *arenas[0]);
 }
 
 // Check if cluster is bad and try to fix it
 bool FAT::isClusterBad(char* buffer, int32 cluster)
 {
+    Stats::add(STAT_BAD_CHECKS);
     // Compare first and last 8 bytes, if they dont match or doesnt contain letter F, cluster is fine
     for (uint8 i = 0; i < 8; i++)
         if (buffer[i] != buffer[br.cluster_size - 8 + i] || buffer[i] != 'F')
             return false;
 
-    std::random_device rd;
-    std::mt19937 eng(rd());
+    // Every thread seeds its generator once
+    static thread_local std::mt19937 eng(std::random_device{}());
     std::uniform_int_distribution<> distr(0, RANDOM_RANGE);
 
     {
         // Set to f so next time we dont detect it as bad sector next time
         memset(buffer, 'f', 8);
         memset(buffer + br.cluster_size - 8, 'f', 8);
-        Guard guard(loadLock);
-        fseek(file, dataStart + cluster*(br.cluster_size), SEEK_SET);
-        fwrite(buffer, sizeof(char)* br.cluster_size, 1, file);
+        if (cache)
+            cache->write(cluster, buffer, true);
+        else
+            image->write(buffer, br.cluster_size, clusterOffset(cluster));
     }
 
     std::cout << "\nFirst and last 8 bytes lost!";
@@ -554,27 +1505,35 @@ std::string FAT::absName(Node* node)
     return absName(node->parent) + "/" + node->name;
 }
 
-// Find node in filesystem
-Node* FAT::find(Node* curr, std::string fileName)
+// Find node in filesystem by path relative to curr, leading, trailing and double / are ignored
+Node* FAT::find(Node* curr, const std::string& path)
 {
-    if (fileName.empty())
-        return curr;
-
-    for (auto child : curr->childs)
+    PathTokenizer tokenizer(path);
+    const char* name;
+    size_t size;
+    while (tokenizer.next(name, size))
     {
-        if (child->name == fileName)
-            return child;
-        else if (!child->isFile && fileName.find(child->name+"/") == 0)
+        // Only dirs can have more path after them
+        if (curr->isFile)
+            return nullptr;
+        // Hashed dir can find name by reading few clusters, if probe cant tell whole dir is loaded
+        Node* child = hashed_dirs && !curr->loaded ? probeDir(curr, name, size) : nullptr;
+        if (!child)
         {
-            return find(child, fileName.substr(child->name.size()+1));
+            ensureLoaded(curr);
+            child = curr->findChild(name, size);
         }
+        curr = child;
+        if (!curr)
+            return nullptr;
     }
-    return nullptr;
+    return curr;
 }
 
 // 
 void FAT::printFat()
 {
+    loadAll();
     if (root->childs.empty())
     {
         std::cout << "Empty" << std::endl;
@@ -588,7 +1547,7 @@ void FAT::print(Node* node, uint32 level)
 {
     for (uint32 i = 0; i < level; i++)
         std::cout << "\t";
-    std::cout << (node->isFile ? "-" : "+") << (node->name.empty() ? "ROOT" : node->name);
+    std::cout << (node->isFile ? "-" : "+") << (node->name[0] ? node->name : "ROOT");
 
     if (!node->isFile)
     {
@@ -613,52 +1572,106 @@ void FAT::extractFilename(std::string& str)
     str = str.substr(found + 1);
 }
 
-void FAT::relocateBadDirsClusters()
+// Move bad dir clusters found while loading into free clusters, returns number of moved ones
+uint32 FAT::relocateBadDirsClusters()
 {
+    uint32 relocated = 0;
+    TraceSpan span("relocate bad dirs");
     if (!badClusters.empty())
         std::cout << std::endl;
-    for (auto node : badClusters)
+    for (auto& item : badClusters)
     {
+        Node* node = item.node;
+        // First cluster of root cant move, root is always at cluster 0
+        if (!node->parent && item.start == node->cluster)
+            throw std::runtime_error("Corrupted FAT!");
+        // Earlier relocations could change chain, find cluster before bad one again
+        int32 prevCluster;
+        if (!findPrevCluster(node, item.start, prevCluster))
+            continue;
         int32 cluster = findFreeCluster();
         if (cluster == -1)
             throw std::runtime_error("Not enough room for realocate bad cluster!");
-        moveCluster(node->cluster, cluster);
-        for (int8 i = 0; i < br.fat_copies; i++)
-        {
-            fatTables[i][cluster] = FAT_DIRECTORY;
-            fatTables[i][node->cluster] = FAT_BAD_CLUSTER;
-        }
-        updateFatTables();
-        std::cout << "Moving bad dir cluster from " << (int)node->cluster << " to " << (int)cluster << std::endl;
-        node->cluster = cluster;
-        if (node->parent)
-            updateCluster(node->parent);
-        else
-            throw std::runtime_error("Corrupted FAT!");
+        std::cout << "Moving bad dir cluster from " << (int)item.start << " to " << (int)cluster << std::endl;
+        relocateCluster(node, prevCluster, item.start, cluster);
+        buildExtents(node, *arenas[0]);
+        relocated++;
     }
+    // Whole batch is written with one flush
+    if (!badClusters.empty())
+        updateFatTables();
     badClusters.clear();
+    return relocated;
+}
+
+// Move bad cluster of file or dir into newCluster, prevCluster is cluster before it in chain or -1 if it is first one
+void FAT::relocateCluster(Node* node, int32 prevCluster, int32 cluster, int32 newCluster)
+{
+    if (prevCluster == -1)
+    {
+        node->cluster = newCluster;
+        updateEntry(node);
+    }
+    setCluster(newCluster, fatTables[0][cluster]);
+    if (prevCluster != -1)
+        setCluster(prevCluster, newCluster);
+    moveCluster(cluster, newCluster);
+    setCluster(cluster, FAT_BAD_CLUSTER);
+}
+
+// Find cluster before cluster in chain of node, -1 if it is first one. False if chain doesnt reach it,
+// walk is bounded so broken or cyclic chain cant run out of fat or loop forever.
+bool FAT::findPrevCluster(Node* node, int32 cluster, int32& prevCluster)
+{
+    prevCluster = -1;
+    int32 current = node->cluster;
+    for (int32 steps = 0; steps < br.usable_cluster_count && current >= 0 && current < br.usable_cluster_count; steps++)
+    {
+        if (current == cluster)
+            return true;
+        prevCluster = current;
+        current = fatTables[0][current];
+    }
+    return false;
 }
 
 void FAT::moveCluster(int32 oldCluster, int32 newCluster)
 {
-    char* buffer = new char[br.cluster_size];
-    fseek(file, dataStart + oldCluster*(br.cluster_size), SEEK_SET);
-    fread(buffer, br.cluster_size, 1, file);
-    fseek(file, dataStart + newCluster*(br.cluster_size), SEEK_SET);
-    fwrite(buffer, br.cluster_size, 1, file);
-    delete[] buffer;
+    Stats::add(STAT_MOVES);
+    Stats::add(STAT_MOVE_BYTES, br.cluster_size);
+    if (image->data())
+        memcpy(clusterData(newCluster), clusterData(oldCluster), br.cluster_size);
+    else if (cache)
+    {
+        cache->write(newCluster, cache->pin(oldCluster), true);
+        cache->unpin(oldCluster);
+    }
+    else
+    {
+        char* buffer = new char[br.cluster_size];
+        image->read(buffer, br.cluster_size, clusterOffset(oldCluster));
+        image->write(buffer, br.cluster_size, clusterOffset(newCluster));
+        delete[] buffer;
+    }
     clearCluster(oldCluster);
 }
 
 void FAT::corruptCluster(int32 cluster)
 {
+    if (cache)
+    {
+        char* data = cache->pin(cluster);
+        memset(data, 'F', 8);
+        memset(data + br.cluster_size - 8, 'F', 8);
+        cache->unpin(cluster, true);
+        return;
+    }
     char* buffer = new char[br.cluster_size];
-    fseek(file, dataStart + cluster*(br.cluster_size), SEEK_SET);
-    fread(buffer, sizeof(char)* br.cluster_size, 1, file);
+    image->read(buffer, br.cluster_size, clusterOffset(cluster));
     memset(buffer, 'F', 8);
     memset(buffer + br.cluster_size - 8, 'F', 8);
-    fseek(file, dataStart + cluster*(br.cluster_size), SEEK_SET);
-    fwrite(buffer, sizeof(char)* br.cluster_size, 1, file);
+    image->write(buffer, br.cluster_size, clusterOffset(cluster));
+    delete[] buffer;
 }
 
 void FAT::printFirstFewFatRows()
@@ -687,3 +1700,462 @@ void FAT::printFirstFewFatRows()
         std::cout << std::endl;
     }
 }
+
+// Print usage of clusters counted from fat table and fragmentation of files
+void FAT::printStats()
+{
+    loadAll();
+    int32 count = br.usable_cluster_count;
+    FatCounts counts = {};
+    countEntries(fatTables[0], count, counts);
+
+    // Walk whole tree, file with more than one extent is fragmented
+    uint64 files = 0;
+    uint64 dirs = 0;
+    uint64 dirClusters = 0;
+    uint64 fragmented = 0;
+    uint64 extents = 0;
+    std::vector<Node*> stack(1, root);
+    while (!stack.empty())
+    {
+        Node* node = stack.back();
+        stack.pop_back();
+        if (node->isFile)
+        {
+            files++;
+            extents += node->extents.size();
+            if (node->extents.size() > 1)
+                fragmented++;
+            continue;
+        }
+        dirs++;
+        // Only last cluster of dir chain is marked as directory
+        for (auto& extent : node->extents)
+            dirClusters += extent.length;
+        stack.insert(stack.end(), node->childs.begin(), node->childs.end());
+    }
+
+    uint64 used = counts.next + counts.fileEnd + counts.directory;
+    std::cout << "Clusters: " << count << " of " << br.cluster_size << " bytes" << std::endl;
+    std::cout << "Free: " << counts.unused << std::endl;
+    std::cout << "Used: " << used << " (files " << used - dirClusters << ", dirs " << dirClusters << ")" << std::endl;
+    std::cout << "Bad: " << counts.bad << std::endl;
+    std::cout << "Files: " << files << ", dirs: " << dirs << std::endl;
+    std::cout << "Fragmented files: " << fragmented;
+    if (files)
+        std::cout << " (" << fragmented * 100 / files << "%), extents per file: " << (double)extents / files;
+    std::cout << std::endl;
+
+    for (uint8 i = 1; i < br.fat_copies; i++)
+    {
+        int32 diff = findMirrorDiff(i, 0);
+        std::cout << "Fat copy " << (int)i;
+        if (diff < 0)
+            std::cout << " matches" << std::endl;
+        else
+            std::cout << " differs from cluster " << diff << std::endl;
+    }
+    std::cout << "Scan kernel: " << scanKernelName() << std::endl;
+    printCacheStats();
+}
+
+// Print counters of cluster cache if it is used
+void FAT::printCacheStats()
+{
+    if (!cache)
+        return;
+    std::cout << "Cache: " << cache->hits() << " hits, " << cache->misses() << " misses, " << cache->writebacks() << " writebacks, " << cache->evictions() << " evictions" << std::endl;
+}
+
+// Check that fat copies agree, every chain is valid and owned by one node and that no cluster is lost, fix found problems if repair is set
+void FAT::check(bool repair)
+{
+    loadAll();
+    int32 count = br.usable_cluster_count;
+    uint64 problems = 0;
+
+    // Mirrors must be same as primary table
+    for (uint8 i = 1; i < br.fat_copies; i++)
+    {
+        uint64 diffs = 0;
+        std::vector<Extent> runs;
+        findMirrorDiffs(i, runs);
+        for (auto& run : runs)
+        {
+            diffs += run.length;
+            if (!repair)
+                continue;
+            // Not loaded mirror is rewritten from primary range
+            if (i < loadedCopies)
+            {
+                std::copy(fatTables[0] + run.start, fatTables[0] + run.start + run.length, fatTables[i] + run.start);
+                dirtyFat[i].add(run.start, run.start + run.length);
+            }
+            else
+                dirtyFat[0].add(run.start, run.start + run.length);
+        }
+        if (diffs)
+            std::cout << "Fat copy " << (int)i << " differs in " << diffs << " clusters, first is " << runs[0].start << std::endl;
+        problems += diffs;
+    }
+
+    // Every node is checked, workers take them from shared list
+    std::vector<Node*> nodes;
+    std::vector<Node*> stack(1, root);
+    while (!stack.empty())
+    {
+        Node* node = stack.back();
+        stack.pop_back();
+        nodes.push_back(node);
+        stack.insert(stack.end(), node->childs.begin(), node->childs.end());
+    }
+
+    // Shared cluster is kept by first node in this order, so report and repair dont depend on threads
+    uint8 workers = std::max((uint8)1, max_threads);
+    std::vector<std::atomic<uint32>> owners(count);
+    for (auto& owner : owners)
+        owner.store(UINT32_MAX, std::memory_order_relaxed);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread*> threads;
+    for (uint8 i = 0; i < workers; i++)
+        threads.push_back(new std::thread(&FAT::claimChains, this, &nodes, &next, owners.data()));
+    for (auto* thread : threads)
+    {
+        thread->join();
+        delete thread;
+    }
+    threads.clear();
+
+    AtomicBitmap visited(count);
+    next = 0;
+    std::vector<std::vector<ChainProblem>> chainProblems(workers);
+    for (uint8 i = 0; i < workers; i++)
+        threads.push_back(new std::thread(&FAT::checkChains, this, &nodes, &next, owners.data(), &visited, &chainProblems[i]));
+    for (auto* thread : threads)
+    {
+        thread->join();
+        delete thread;
+    }
+    threads.clear();
+
+    // Used clusters which no chain reached, fat range is split between workers
+    std::vector<std::vector<int32>> orphans(workers);
+    int32 part = (count + workers - 1) / workers;
+    for (uint8 i = 0; i < workers; i++)
+    {
+        int32 from = std::min(count, i * part);
+        threads.push_back(new std::thread(&FAT::checkOrphans, this, from, std::min(count, from + part), &visited, &orphans[i]));
+    }
+    for (auto* thread : threads)
+    {
+        thread->join();
+        delete thread;
+    }
+
+    // Report in path order so output dont depend on threads
+    std::vector<std::pair<std::string, ChainProblem*>> found;
+    for (auto& list : chainProblems)
+        for (auto& problem : list)
+            found.push_back(std::make_pair(problem.node->parent ? absName(problem.node) : "/", &problem));
+    std::sort(found.begin(), found.end(), [](const std::pair<std::string, ChainProblem*>& a, const std::pair<std::string, ChainProblem*>& b)
+    {
+        return a.first < b.first;
+    });
+    for (auto& problem : found)
+        std::cout << problem.first << ": " << problem.second->message << std::endl;
+    problems += found.size();
+
+    uint64 orphaned = 0;
+    for (auto& list : orphans)
+        orphaned += list.size();
+    if (orphaned)
+        std::cout << "Orphaned clusters: " << orphaned << std::endl;
+    problems += orphaned;
+
+    std::cout << "Checked " << nodes.size() << " files and dirs, found " << problems << " problems" << std::endl;
+    if (!repair || !problems)
+        return;
+
+    for (auto& problem : found)
+        repairChain(*problem.second);
+    for (auto& list : orphans)
+        for (auto cluster : list)
+            setCluster(cluster, FAT_UNUSED);
+    updateFatTables();
+    std::cout << "OK" << std::endl;
+}
+
+// Every cluster is claimed by node with lowest index whose chain reaches it.
+// Walk ends on cluster of lower node, rest of chain is claimed by that node, or on cluster it claimed already when chain loops.
+void FAT::claimChains(const std::vector<Node*>* nodes, std::atomic<size_t>* next, std::atomic<uint32>* owners)
+{
+    int32 count = br.usable_cluster_count;
+    const int32* fat = fatTables[0];
+    size_t i;
+    while ((i = (*next)++) < nodes->size())
+    {
+        Node* node = (*nodes)[i];
+        int32 cluster = node->cluster;
+        while (cluster >= 0 && cluster < count)
+        {
+            int32 value = fat[cluster];
+            // File chain dont own cluster where it breaks, same as checkChains counts it
+            if (node->isFile && (value == FAT_UNUSED || value == FAT_BAD_CLUSTER || value == FAT_DIRECTORY))
+                break;
+            uint32 owner = owners[cluster].load(std::memory_order_relaxed);
+            while (owner > i && !owners[cluster].compare_exchange_weak(owner, (uint32)i, std::memory_order_relaxed))
+                ;
+            if (owner <= i)
+                break;
+            cluster = value;
+        }
+    }
+}
+
+// Walk chains of nodes from shared list, cluster claimed by other node is shared and cluster seen second time loops
+void FAT::checkChains(const std::vector<Node*>* nodes, std::atomic<size_t>* next, std::atomic<uint32>* owners, AtomicBitmap* visited,
+    std::vector<ChainProblem>* problems)
+{
+    int32 count = br.usable_cluster_count;
+    const int32* fat = fatTables[0];
+    size_t i;
+    while ((i = (*next)++) < nodes->size())
+    {
+        ChainProblem problem;
+        problem.node = (*nodes)[i];
+        problem.length = 0;
+        int32 cluster = problem.node->cluster;
+        if (cluster < 0 || cluster >= count)
+            problem.message = "starts outside of fat at cluster " + std::to_string(cluster);
+        else if (!problem.node->isFile)
+        {
+            // Chain of dir ends with directory mark
+            while (true)
+            {
+                if (!ownChainCluster(nodes, owners, visited, i, cluster, problem.message))
+                    break;
+                problem.length++;
+                int32 value = fat[cluster];
+                if (value == FAT_DIRECTORY)
+                    break;
+                if (value < 0 || value >= count)
+                {
+                    problem.message = "cluster " + std::to_string(cluster) + " is not marked as directory";
+                    break;
+                }
+                cluster = value;
+            }
+        }
+        else
+        {
+            // Chain cant loop forever, cluster seen second time is already visited
+            while (true)
+            {
+                int32 value = fat[cluster];
+                if (value == FAT_UNUSED || value == FAT_BAD_CLUSTER || value == FAT_DIRECTORY)
+                {
+                    problem.message = "chain runs into unused, bad or dir cluster " + std::to_string(cluster);
+                    break;
+                }
+                if (!ownChainCluster(nodes, owners, visited, i, cluster, problem.message))
+                    break;
+                problem.length++;
+                if (value == FAT_FILE_END)
+                    break;
+                if (value < 0 || value >= count)
+                {
+                    problem.message = "chain leaves fat after cluster " + std::to_string(cluster);
+                    break;
+                }
+                cluster = value;
+            }
+
+            int64_t needed = std::max<int64_t>(1, ((int64_t)problem.node->size + br.cluster_size - 1) / br.cluster_size);
+            if (problem.message.empty() && problem.length != needed)
+                problem.message = "size " + std::to_string(problem.node->size) + " needs " + std::to_string(needed) + " clusters but chain have " + std::to_string(problem.length);
+        }
+        if (!problem.message.empty())
+            problems->push_back(problem);
+    }
+}
+
+// True if cluster belongs to chain of node with given index, otherwise message says it is shared or chain loops
+bool FAT::ownChainCluster(const std::vector<Node*>* nodes, std::atomic<uint32>* owners, AtomicBitmap* visited, size_t index, int32 cluster,
+    std::string& message)
+{
+    uint32 owner = owners[cluster].load(std::memory_order_relaxed);
+    if (owner != index)
+    {
+        Node* other = (*nodes)[owner];
+        message = "cluster " + std::to_string(cluster) + " is shared with " + (other->parent ? absName(other) : "/");
+        return false;
+    }
+    if (visited->testAndSet(cluster))
+    {
+        message = "chain loops at cluster " + std::to_string(cluster);
+        return false;
+    }
+    return true;
+}
+
+// Collect used clusters in range which no chain visited
+void FAT::checkOrphans(int32 from, int32 to, AtomicBitmap* visited, std::vector<int32>* orphans)
+{
+    const int32* fat = fatTables[0];
+    for (int32 cluster = from; cluster < to; cluster++)
+        if (fat[cluster] != FAT_UNUSED && fat[cluster] != FAT_BAD_CLUSTER && !visited->test(cluster))
+            orphans->push_back(cluster);
+}
+
+// Cut chain after its valid part and fit size to it, file without valid cluster is removed
+void FAT::repairChain(const ChainProblem& problem)
+{
+    Node* node = problem.node;
+    if (!node->isFile)
+    {
+        // Shared first cluster cant be fixed without losing content, otherwise chain ends at its last valid cluster
+        if (!problem.length)
+            return;
+        int32 last = node->cluster;
+        for (int32 i = 1; i < problem.length; i++)
+            last = fatTables[0][last];
+        setCluster(last, FAT_DIRECTORY);
+        // Childs from cut clusters get slots in clusters which are left
+        layoutDir(node);
+        return;
+    }
+
+    if (!problem.length)
+    {
+        removeEntry(node);
+        return;
+    }
+
+    int64_t needed = std::max<int64_t>(1, ((int64_t)node->size + br.cluster_size - 1) / br.cluster_size);
+    int32 keep = (int32)std::min<int64_t>(problem.length, needed);
+    int32 last = node->cluster;
+    for (int32 i = 1; i < keep; i++)
+        last = fatTables[0][last];
+
+    // Free rest of valid chain which is not needed for size
+    int32 cluster = fatTables[0][last];
+    setCluster(last, FAT_FILE_END);
+    for (int32 i = keep; i < problem.length; i++)
+    {
+        int32 following = fatTables[0][cluster];
+        setCluster(cluster, FAT_UNUSED);
+        cluster = following;
+    }
+
+    if (node->size > (int64_t)keep * br.cluster_size)
+    {
+        node->size = keep * br.cluster_size;
+        updateEntry(node);
+    }
+    buildExtents(node, *arenas[0]);
+}
+
+// Read all used clusters in parallel and relocate bad ones in one batch, rate limits reading in MB/s, zero means no limit
+void FAT::scrub(uint32 rate)
+{
+    loadAll();
+    // Pieces are read straight from disk so scan doesnt push everything out of cache, disk must have cached changes
+    if (cache)
+        cache->flush();
+
+    // Split runs of dirs and files into pieces which are read at once
+    std::vector<ScrubItem> items;
+    int32 piece = std::max<int32>(1, READAHEAD_MAX / br.cluster_size);
+    std::vector<Node*> stack(1, root);
+    while (!stack.empty())
+    {
+        Node* node = stack.back();
+        stack.pop_back();
+        stack.insert(stack.end(), node->childs.begin(), node->childs.end());
+        for (auto& extent : node->extents)
+            for (int32 start = extent.start; start < extent.start + extent.length; start += piece)
+            {
+                ScrubItem item = { node, start, std::min(piece, extent.start + extent.length - start) };
+                items.push_back(item);
+            }
+    }
+
+    uint8 workers = std::max((uint8)1, max_threads);
+    std::atomic<size_t> next(0);
+    std::atomic<uint64> scanned(0);
+    std::vector<std::vector<ScrubItem>> bad(workers);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread*> threads;
+    for (uint8 i = 0; i < workers; i++)
+        threads.push_back(new std::thread(&FAT::scrubWorker, this, &items, &next, &scanned, rate, start, &bad[i]));
+    for (auto* thread : threads)
+    {
+        thread->join();
+        delete thread;
+    }
+
+    // Relocate whole batch, fat is flushed once at end
+    uint64 relocated = 0;
+    for (auto& list : bad)
+        for (auto& item : list)
+        {
+            if (!item.node->isFile)
+            {
+                badClusters.push_back(item);
+                continue;
+            }
+            // Earlier relocations could change chain, find cluster before bad one again
+            int32 prevCluster;
+            if (!findPrevCluster(item.node, item.start, prevCluster))
+                continue;
+            int32 newCluster = findFreeCluster();
+            if (newCluster == -1)
+                throw std::runtime_error("Not enough room for realocate bad cluster!");
+            relocateCluster(item.node, prevCluster, item.start, newCluster);
+            buildExtents(item.node, *arenas[0]);
+            relocated++;
+        }
+    // Only clusters which really moved are counted, dir clusters which are no longer in chain are skipped
+    relocated += relocateBadDirsClusters();
+    updateFatTables();
+
+    std::cout << "Scrubbed " << scanned / br.cluster_size << " clusters, relocated " << relocated << " bad clusters" << std::endl;
+    std::cout << "OK" << std::endl;
+}
+
+// Worker of scrub, checks pieces taken from shared list, bad clusters are returned as items of length one
+void FAT::scrubWorker(const std::vector<ScrubItem>* items, std::atomic<size_t>* next, std::atomic<uint64>* scanned, uint32 rate,
+    std::chrono::steady_clock::time_point start, std::vector<ScrubItem>* bad)
+{
+    std::vector<char> buffer(image->data() ? 0 : (size_t)std::max(1, READAHEAD_MAX / br.cluster_size) * br.cluster_size);
+    size_t i;
+    while ((i = (*next)++) < items->size())
+    {
+        TraceSpan span("scrub");
+        const ScrubItem& item = (*items)[i];
+        size_t size = (size_t)item.length*br.cluster_size;
+        if (!buffer.empty())
+        {
+            // Short read past end of file, treat rest as empty same as loading dirs does
+            size_t res = image->read(buffer.data(), size, clusterOffset(item.start));
+            if (res < size)
+                memset(&buffer[res], 0, size - res);
+        }
+
+        for (int32 j = 0; j < item.length; j++)
+        {
+            int32 cluster = item.start + j;
+            char* data = image->data() ? clusterData(cluster) : &buffer[(size_t)j*br.cluster_size];
+            if (isClusterBad(data, cluster))
+            {
+                ScrubItem found = { item.node, cluster, 1 };
+                bad->push_back(found);
+            }
+        }
+
+        // Wait until reading so far fits into rate
+        uint64 total = (*scanned += size);
+        if (rate)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(total * 1000000 / ((uint64)rate << 20)));
+    }
+}
@@ -1,11 +1,15 @@
 #pragma once
 #include "util.h"
+#include "bitmap.h"
+#include "ranges.h"
 #include <string>
 #include <mutex>
 #include <atomic>
 #include <deque>
 #include <vector>
-#include <condition_variable>
+#include <set>
+#include <utility>
+#include <chrono>
 
 //pocitame s FAT32 MAX - tedy horni 4 hodnoty
 enum clusterTypes :int32
@@ -36,61 +40,152 @@ struct Directory
 };// 22B
 
 
+// Problem which check found on node, length is number of valid clusters in its chain which repair can keep
+struct ChainProblem
+{
+    class Node* node;
+    std::string message;
+    int32 length;
+};
+
+// Run of clusters of node checked by scrub at once
+struct ScrubItem
+{
+    class Node* node;
+    int32 start;
+    int32 length;
+};
+
 class FAT
 {
+    // Benchmarks measure private parts directly
+    friend class Bench;
 public:
     FAT(std::string filename);
     ~FAT();
 private:
+    void open(const std::string& filename);
+    void release();
     void loadBootRecod();
     void loadFatTables();
     void loadFS();
-    void loadDir(class Node* root);
+    void loadAll();
+    void loadDirs(const std::vector<class Node*>& dirs);
+    void collectUnloaded(Node* node, std::vector<Node*>& dirs);
+    void ensureLoaded(Node* node);
+    void loadDir(class Node* root, std::vector<Node*>& subdirs, class NodeArena& arena);
 
-    void dirLoader();
+    void prepareDir(Node* dir, NodeArena& arena);
+    void loadDirPart(Node* dir, int32 part, NodeArena& arena);
+    void parseDir(Node* parent, char* buffer, int32 part, int32 cluster, NodeArena& arena);
+    void finishDir(Node* dir, std::vector<Node*>& subdirs, NodeArena& arena);
+    Node* entryNode(Node* parent, Directory& entry, uint32 slot, NodeArena& arena);
+    Node* probeDir(Node* dir, const char* name, size_t size);
+    bool probeCluster(Node* dir, char* buffer, int32 part, const char* name, size_t size, Node*& child);
+    bool loadDirsAsync(const std::vector<Node*>& dirs);
+    void dirLoader(class WorkScheduler* scheduler, uint8 worker);
 
     void _printFile(Node* file);
-    Node* find(Node* curr, std::string fileName);
+    Node* find(Node* curr, const std::string& path);
 
     void print(Node* node, uint32 level);
     void updateFatTables();
+    void writeFatTables();
     void clearCluster(int32 cluster);
-    void updateCluster(Node* node);
-    void removeFromFatTables(int32 cluster, uint8 tableIndex, clusterTypes last);
+    int32 dirCluster(Node* dir, int32 part);
+    bool hasFreeSlot(Node* dir);
+    uint32 growClusters(Node* dir);
+    void growDir(Node* dir, uint32 clusters);
+    uint32 hashedSlot(Node* dir, const char* name);
+    uint32 freeSlot(Node* dir, const char* name);
+    void addEntry(Node* dir, Node* child);
+    void removeEntry(Node* child);
+    void updateEntry(Node* child);
+    void layoutDir(Node* dir);
+    void updateCluster(Node* dir, int32 part);
+    void writeCluster(Node* dir, int32 part);
+    void writeMetadata(uint32 type, const void* data, size_t size, uint64 offset);
+    void removeFromFatTables(const std::vector<Extent>& extents);
+    void buildExtents(Node* node, NodeArena& arena);
+    int32 walkChain(Node* node, NodeArena& arena, int32 limit);
+    void clearClusters(const Extent& extent);
+    void setCluster(int32 cluster, int32 value);
+    void setChain(const std::vector<Extent>& extents);
     int32 findFreeCluster();
-    void findFreeClusters(std::vector<int32>& clusters, int32 nrCluster);
-    void secureLoadDirs(char*buffer, long offset);
-    void relocateBadDirsClusters();
+    bool findFreeClusters(std::vector<Extent>& extents, int32 nrCluster);
+    void secureLoadDirs(char*buffer, uint64 offset);
+    uint64 clusterOffset(int32 cluster);
+    char* clusterData(int32 cluster);
+    uint32 relocateBadDirsClusters();
     void moveCluster(int32 oldCluster, int32 newCluster);
+    void claimChains(const std::vector<Node*>* nodes, std::atomic<size_t>* next, std::atomic<uint32>* owners);
+    void checkChains(const std::vector<Node*>* nodes, std::atomic<size_t>* next, std::atomic<uint32>* owners, class AtomicBitmap* visited,
+        std::vector<ChainProblem>* problems);
+    bool ownChainCluster(const std::vector<Node*>* nodes, std::atomic<uint32>* owners, AtomicBitmap* visited, size_t index, int32 cluster,
+        std::string& message);
+    void checkOrphans(int32 from, int32 to, AtomicBitmap* visited, std::vector<int32>* orphans);
+    void repairChain(const ChainProblem& problem);
+    void relocateCluster(Node* node, int32 prevCluster, int32 cluster, int32 newCluster);
+    bool findPrevCluster(Node* node, int32 cluster, int32& prevCluster);
+    void scrubWorker(const std::vector<ScrubItem>* items, std::atomic<size_t>* next, std::atomic<uint64>* scanned, uint32 rate,
+        std::chrono::steady_clock::time_point start, std::vector<ScrubItem>* bad);
+    int32 findMirrorDiff(uint8 copy, int32 from);
+    void findMirrorDiffs(uint8 copy, std::vector<Extent>& diffs);
+    void verifyMirrors();
 public:
     void addFile(std::string file, std::string fatDir);
     void createDir(std::string dir, std::string parentDir);
     void remove(std::string name, clusterTypes type);
-    void printFileClusters(std::string fileName);
+    void printFileClusters(std::string fileName, bool ranges = false);
     void printFile(std::string fileName);
+    void exportFile(std::string fileName, std::string hostFile);
     void printFat();
     bool isClusterBad(char* buffer, int32 cluster);
     std::string absName(Node* node);
     static void extractFilename(std::string& str);
     void corruptCluster(int32 cluster);
     void printFirstFewFatRows();
+    void printStats();
+    void printCacheStats();
+    void check(bool repair);
+    void scrub(uint32 rate);
+    void setDeferred(bool deferred);
+    void sync();
+    void abort();
 public:
     static uint8 max_threads;
+    static bool use_mmap;
+    static bool lazy_load;
+    static bool single_fat;
+    static bool async_load;
+    static bool use_journal;
+    static bool hashed_dirs;
+    static uint64 cache_size;
 private:
     BootRecord br;
     int32** fatTables;
-    FILE* file;
+    // Copies held in memory, with single_fat only primary is loaded and mirrors are written from it
+    uint8 loadedCopies;
+    class ImageIO* image;
+    // Tree lives in arenas, one for every loader thread, first one is used by main thread
+    std::vector<NodeArena*> arenas;
     uint32 maxDirs;
-    uint32 dataStart;
+    uint64 dataStart;
     Node* root;
+    ClusterBitmap freeClusters;
+    // Fat entries changed since last update of fat tables, one set for every copy
+    std::vector<DirtyRanges> dirtyFat;
+    // Clusters of dirs which wait for sync, as dir and number of cluster in its chain
+    bool deferWrites;
+    std::set<std::pair<Node*, int32>> dirtyDirs;
+    class Journal* journal;
+    class ClusterCache* cache;
+    // Cached dir clusters written into open transaction, pinned until commit puts them on disk
+    std::vector<int32> journalPins;
+    // Clusters freed in open transaction, they keep old content and cant be taken again until commit
+    std::vector<Extent> journalFreed;
 
-    std::mutex loadLock;
-    std::mutex dirsLock;
-    std::mutex condLock;
+    // Bad dir clusters found while loading
     std::mutex badClustersLock;
-    std::condition_variable condition;
-    std::deque<Node*> dirsToLoad;
-    std::deque<Node*> badClusters;
-    std::atomic<uint32> working;
-    std::atomic<uint32> dirs;
+    std::deque<ScrubItem> badClusters;
 };
\ No newline at end of file
@@ -0,0 +1,34 @@
+#include "arena.h"
+
+NodeArena::NodeArena()
+    : pos(nullptr)
+    , end(nullptr)
+{
+}
+
+NodeArena::~NodeArena()
+{
+    for (auto chunk : chunks)
+        delete[] chunk;
+}
+
+// Get memory aligned for any tree structure, bigger requests than chunk get own chunk
+void* NodeArena::allocate(size_t size)
+{
+    size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    if (size > (size_t)(end - pos))
+    {
+        if (size > CHUNK_SIZE / 4)
+        {
+            char* chunk = new char[size];
+            chunks.push_back(chunk);
+            return chunk;
+        }
+        pos = new char[CHUNK_SIZE];
+        end = pos + CHUNK_SIZE;
+        chunks.push_back(pos);
+    }
+    void* result = pos;
+    pos += size;
+    return result;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include "util.h"
+#include <vector>
+#include <cstring>
+
+// Bump allocator for tree metadata, every loader thread have own one so no locking is needed, memory is freed all at once with arena
+class NodeArena
+{
+public:
+    NodeArena();
+    ~NodeArena();
+
+    void* allocate(size_t size);
+    template <class T>
+    T* allocateArray(size_t count)
+    {
+        return (T*)allocate(sizeof(T)*count);
+    }
+private:
+    enum { CHUNK_SIZE = 256 << 10, ALIGN = 8 };
+    std::vector<char*> chunks;
+    char* pos;
+    char* end;
+};
+
+// Array of trivially copyable items living in arena, growing leaves old array in arena until it is freed
+template <class T>
+class ArenaList
+{
+public:
+    ArenaList()
+        : items(nullptr)
+        , count(0)
+        , capacity(0)
+    {
+    }
+
+    T* begin() const { return items; }
+    T* end() const { return items + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t i) const { return items[i]; }
+
+    void push_back(const T& item, NodeArena& arena)
+    {
+        if (count == capacity)
+            reserve(capacity ? capacity * 2 : 1, arena);
+        items[count++] = item;
+    }
+
+    void erase(T* item)
+    {
+        memmove(item, item + 1, (end() - item - 1)*sizeof(T));
+        count--;
+    }
+
+    void clear()
+    {
+        count = 0;
+    }
+
+    // Replace content by size copies of value
+    void fill(size_t size, const T& value, NodeArena& arena)
+    {
+        count = 0;
+        if (size > capacity)
+            reserve(size, arena);
+        for (size_t i = 0; i < size; i++)
+            items[i] = value;
+        count = (uint32)size;
+    }
+
+    // Replace content by copy of array
+    void assign(const T* data, size_t size, NodeArena& arena)
+    {
+        count = 0;
+        if (size > capacity)
+            reserve(size, arena);
+        memcpy(items, data, size*sizeof(T));
+        count = (uint32)size;
+    }
+private:
+    void reserve(size_t size, NodeArena& arena)
+    {
+        T* bigger = arena.allocateArray<T>(size);
+        if (count)
+            memcpy(bigger, items, count*sizeof(T));
+        items = bigger;
+        capacity = (uint32)size;
+    }
+
+    T* items;
+    uint32 count;
+    uint32 capacity;
+};
@@ -0,0 +1,203 @@
+#include "bitmap.h"
+#include "FAT.h"
+#include "fatscan.h"
+
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline uint32 ctz(uint64 word)
+{
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return index;
+}
+static inline uint32 popcount(uint64 word)
+{
+    return (uint32)__popcnt64(word);
+}
+#else
+static inline uint32 ctz(uint64 word)
+{
+    return __builtin_ctzll(word);
+}
+static inline uint32 popcount(uint64 word)
+{
+    return __builtin_popcountll(word);
+}
+#endif
+
+// Build index from fat table
+void ClusterBitmap::build(const int32* fat, int32 _count)
+{
+    count = _count;
+    badCount = 0;
+    freeCount = 0;
+    levels.clear();
+
+    // Bottom level, bit is set if cluster is free, built in one pass over table
+    std::vector<uint64> bits((count + 63) / 64, 0);
+    unusedBits(fat, count, bits.data());
+    for (auto word : bits)
+        freeCount += popcount(word);
+
+    FatCounts counts = {};
+    countEntries(fat, count, counts);
+    badCount = (int32)counts.bad;
+    levels.push_back(std::move(bits));
+
+    // Summary levels until whole level fits into one word
+    while (levels.back().size() > 1)
+    {
+        std::vector<uint64>& below = levels.back();
+        std::vector<uint64> summary((below.size() + 63) / 64, 0);
+        for (size_t i = 0; i < below.size(); i++)
+            if (below[i])
+                summary[i >> 6] |= 1ULL << (i & 63);
+        levels.push_back(std::move(summary));
+    }
+}
+
+// Keep index in sync with change of fat entry
+void ClusterBitmap::update(int32 cluster, int32 oldValue, int32 newValue)
+{
+    if (oldValue == newValue)
+        return;
+
+    if (oldValue == FAT_UNUSED)
+    {
+        clear(cluster);
+        freeCount--;
+    }
+    else if (oldValue == FAT_BAD_CLUSTER)
+        badCount--;
+
+    if (newValue == FAT_UNUSED)
+    {
+        set(cluster);
+        freeCount++;
+    }
+    else if (newValue == FAT_BAD_CLUSTER)
+        badCount++;
+}
+
+// Mark cluster free, set summary bits up to first level which already had them
+void ClusterBitmap::set(int32 cluster)
+{
+    uint64 pos = cluster;
+    for (auto& level : levels)
+    {
+        uint64& word = level[pos >> 6];
+        bool wasEmpty = !word;
+        word |= 1ULL << (pos & 63);
+        if (!wasEmpty)
+            break;
+        pos >>= 6;
+    }
+}
+
+// Mark cluster used, clear summary bits while words become empty
+void ClusterBitmap::clear(int32 cluster)
+{
+    uint64 pos = cluster;
+    for (auto& level : levels)
+    {
+        uint64& word = level[pos >> 6];
+        word &= ~(1ULL << (pos & 63));
+        if (word)
+            break;
+        pos >>= 6;
+    }
+}
+
+// Find first set bit on level starting from pos, -1 if there is not one
+int64_t ClusterBitmap::findSet(size_t level, uint64 pos)
+{
+    std::vector<uint64>& words = levels[level];
+    uint64 index = pos >> 6;
+    if (index >= words.size())
+        return -1;
+
+    uint64 word = words[index] & (~0ULL << (pos & 63));
+    if (word)
+        return (index << 6) + ctz(word);
+    if (level + 1 == levels.size())
+        return -1;
+
+    // Ask level above for next non empty word
+    int64_t next = findSet(level + 1, index + 1);
+    if (next < 0)
+        return -1;
+    return (next << 6) + ctz(words[next]);
+}
+
+// Find first free cluster from cluster, return -1 if there is not one
+int32 ClusterBitmap::findFree(int32 from)
+{
+    if (from >= count)
+        return -1;
+    return (int32)findSet(0, from);
+}
+
+// First used cluster after run of free clusters starting at cluster
+int32 ClusterBitmap::runEnd(int32 cluster)
+{
+    std::vector<uint64>& bits = levels[0];
+    uint64 index = (uint64)cluster >> 6;
+    uint64 word = ~bits[index] & (~0ULL << (cluster & 63));
+    while (!word)
+    {
+        if (++index == bits.size())
+            return count;
+        word = ~bits[index];
+    }
+    return std::min<int32>(count, (int32)((index << 6) + ctz(word)));
+}
+
+// Find nrCluster free clusters as runs of consecutive clusters, lowest clusters first
+bool ClusterBitmap::findFreeExtents(std::vector<Extent>& extents, int32 from, int32 nrCluster)
+{
+    if (nrCluster > freeCount)
+        return false;
+
+    int32 cluster = from;
+    while (nrCluster > 0)
+    {
+        cluster = findFree(cluster);
+        if (cluster < 0)
+            return false;
+
+        Extent extent;
+        extent.start = cluster;
+        extent.length = std::min(runEnd(cluster) - cluster, nrCluster);
+        extents.push_back(extent);
+        nrCluster -= extent.length;
+        cluster += extent.length;
+    }
+    return true;
+}
+
+AtomicBitmap::AtomicBitmap(int32 count)
+{
+    size_t size = ((size_t)count + 63) / 64;
+    words = new std::atomic<uint64>[size];
+    for (size_t i = 0; i < size; i++)
+        words[i] = 0;
+}
+
+AtomicBitmap::~AtomicBitmap()
+{
+    delete[] words;
+}
+
+// Set bit, return true if it was already set
+bool AtomicBitmap::testAndSet(int32 bit)
+{
+    uint64 mask = 1ULL << (bit & 63);
+    return (words[bit >> 6].fetch_or(mask) & mask) != 0;
+}
+
+bool AtomicBitmap::test(int32 bit)
+{
+    return (words[bit >> 6].load() >> (bit & 63)) & 1;
+}
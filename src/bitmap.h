@@ -0,0 +1,43 @@
+#pragma once
+#include "util.h"
+#include <vector>
+#include <atomic>
+
+// Index of free clusters, one bit per cluster and summary levels with one bit per non empty word of level below
+class ClusterBitmap
+{
+public:
+    void build(const int32* fat, int32 count);
+    void update(int32 cluster, int32 oldValue, int32 newValue);
+
+    int32 findFree(int32 from);
+    bool findFreeExtents(std::vector<Extent>& extents, int32 from, int32 nrCluster);
+
+    int32 freeClusters() { return freeCount; }
+    int32 badClusters() { return badCount; }
+    int32 usedClusters() { return count - freeCount - badCount; }
+private:
+    void set(int32 cluster);
+    void clear(int32 cluster);
+    int64_t findSet(size_t level, uint64 pos);
+    int32 runEnd(int32 cluster);
+
+    // levels[0] is bitmap of free clusters, last level fits into one word
+    std::vector<std::vector<uint64>> levels;
+    int32 count;
+    int32 freeCount;
+    int32 badCount;
+};
+
+// Plain bitmap which many threads can set at once, used to mark visited clusters
+class AtomicBitmap
+{
+public:
+    AtomicBitmap(int32 count);
+    ~AtomicBitmap();
+
+    bool testAndSet(int32 bit);
+    bool test(int32 bit);
+private:
+    std::atomic<uint64>* words;
+};
@@ -0,0 +1,176 @@
+#include "cache.h"
+#include "image.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+ClusterCache::ClusterCache(ImageIO* _image, uint64 _dataStart, uint32 _clusterSize, uint64 capacity)
+    : image(_image)
+    , dataStart(_dataStart)
+    , clusterSize(_clusterSize)
+    , hitCount(0)
+    , missCount(0)
+    , writebackCount(0)
+    , evictionCount(0)
+{
+    shardCapacity = std::max<size_t>(1, (size_t)(capacity / clusterSize / SHARDS));
+    for (auto& shard : shards)
+        shard.hand = 0;
+}
+
+ClusterCache::~ClusterCache()
+{
+    for (auto& shard : shards)
+        for (auto entry : shard.clock)
+        {
+            delete[] entry->data;
+            delete entry;
+        }
+}
+
+// Get buffer of cluster and keep it in cache until unpin, without load caller must overwrite whole buffer
+char* ClusterCache::pin(int32 cluster, bool load)
+{
+    return pinEntry(cluster, load, nullptr);
+}
+
+// Pin cluster which caller already read from disk, its data is copied in only on miss so newer cached content wins
+char* ClusterCache::fill(int32 cluster, const char* data)
+{
+    return pinEntry(cluster, true, data);
+}
+
+char* ClusterCache::pinEntry(int32 cluster, bool load, const char* data)
+{
+    Shard& shard = shardOf(cluster);
+    Guard guard(shard.lock, std::defer_lock);
+    Stats::lock(guard, STAT_CACHE_WAITS);
+    auto itr = shard.entries.find(cluster);
+    if (itr != shard.entries.end())
+    {
+        hitCount++;
+        Entry* entry = itr->second;
+        entry->pins++;
+        entry->referenced = true;
+        return entry->data;
+    }
+
+    missCount++;
+    Entry* entry = victim(shard);
+    entry->cluster = cluster;
+    entry->pins = 1;
+    entry->dirty = false;
+    entry->referenced = true;
+    if (load && data)
+        memcpy(entry->data, data, clusterSize);
+    else if (load)
+    {
+        // Short read past end of file, treat rest of cluster as empty
+        size_t res = image->read(entry->data, clusterSize, offset(cluster));
+        Stats::add(STAT_CACHE_READS);
+        Stats::add(STAT_CACHE_READ_BYTES, res);
+        if (res < clusterSize)
+            memset(entry->data + res, 0, clusterSize - res);
+    }
+    shard.entries[cluster] = entry;
+    return entry->data;
+}
+
+void ClusterCache::unpin(int32 cluster, bool dirty)
+{
+    Shard& shard = shardOf(cluster);
+    Guard guard(shard.lock, std::defer_lock);
+    Stats::lock(guard, STAT_CACHE_WAITS);
+    Entry* entry = shard.entries[cluster];
+    entry->pins--;
+    entry->dirty |= dirty;
+}
+
+// Replace content of cluster, clean data must already be on disk or be written there by caller
+void ClusterCache::write(int32 cluster, const char* data, bool dirty)
+{
+    char* buffer = pin(cluster, false);
+    if (buffer != data)
+        memcpy(buffer, data, clusterSize);
+    unpin(cluster, dirty);
+}
+
+// Drop clusters which are about to be written directly, their dirty content must not overwrite new one later
+void ClusterCache::discard(const Extent& extent)
+{
+    for (int32 cluster = extent.start; cluster < extent.start + extent.length; cluster++)
+    {
+        Shard& shard = shardOf(cluster);
+        Guard guard(shard.lock, std::defer_lock);
+        Stats::lock(guard, STAT_CACHE_WAITS);
+        auto itr = shard.entries.find(cluster);
+        if (itr == shard.entries.end() || itr->second->pins)
+            continue;
+        // Entry stays in clock as free slot
+        itr->second->cluster = -1;
+        itr->second->dirty = false;
+        itr->second->referenced = false;
+        shard.entries.erase(itr);
+    }
+}
+
+// Write all dirty clusters back to disk
+void ClusterCache::flush()
+{
+    for (auto& shard : shards)
+    {
+        Guard guard(shard.lock, std::defer_lock);
+        Stats::lock(guard, STAT_CACHE_WAITS);
+        for (auto entry : shard.clock)
+            if (entry->dirty)
+                writeBack(entry);
+    }
+}
+
+// Find entry for new cluster, second chance is given to recently used ones, shard grows if everything is pinned
+ClusterCache::Entry* ClusterCache::victim(Shard& shard)
+{
+    if (shard.clock.size() < shardCapacity)
+    {
+        Entry* entry = new Entry();
+        entry->data = new char[clusterSize];
+        shard.clock.push_back(entry);
+        return entry;
+    }
+
+    for (size_t step = 0; step < shard.clock.size() * 2; step++)
+    {
+        Entry* entry = shard.clock[shard.hand];
+        shard.hand = (shard.hand + 1) % shard.clock.size();
+        if (entry->pins)
+            continue;
+        if (entry->referenced)
+        {
+            entry->referenced = false;
+            continue;
+        }
+        if (entry->cluster >= 0)
+        {
+            if (entry->dirty)
+                writeBack(entry);
+            shard.entries.erase(entry->cluster);
+            evictionCount++;
+        }
+        return entry;
+    }
+
+    Entry* entry = new Entry();
+    entry->data = new char[clusterSize];
+    shard.clock.push_back(entry);
+    return entry;
+}
+
+void ClusterCache::writeBack(Entry* entry)
+{
+    if (image->write(entry->data, clusterSize, offset(entry->cluster)) != clusterSize)
+        throw std::runtime_error("Cant write cluster!");
+    entry->dirty = false;
+    writebackCount++;
+}
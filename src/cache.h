@@ -0,0 +1,62 @@
+#pragma once
+#include "util.h"
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+class ImageIO;
+
+// Cache of cluster buffers split into shards by cluster number, each shard evicts by CLOCK.
+// Pinned clusters are never evicted, dirty clusters are written back on eviction or flush.
+class ClusterCache
+{
+public:
+    ClusterCache(ImageIO* image, uint64 dataStart, uint32 clusterSize, uint64 capacity);
+    ~ClusterCache();
+
+    char* pin(int32 cluster, bool load = true);
+    char* fill(int32 cluster, const char* data);
+    void unpin(int32 cluster, bool dirty = false);
+    void write(int32 cluster, const char* data, bool dirty);
+    void discard(const Extent& extent);
+    void flush();
+
+    uint64 hits() { return hitCount; }
+    uint64 misses() { return missCount; }
+    uint64 writebacks() { return writebackCount; }
+    uint64 evictions() { return evictionCount; }
+private:
+    enum { SHARDS = 16 };
+    struct Entry
+    {
+        int32 cluster;
+        uint32 pins;
+        bool dirty;
+        bool referenced;
+        char* data;
+    };
+    struct Shard
+    {
+        std::mutex lock;
+        std::unordered_map<int32, Entry*> entries;
+        std::vector<Entry*> clock;
+        size_t hand;
+    };
+
+    Shard& shardOf(int32 cluster) { return shards[(uint32)cluster % SHARDS]; }
+    char* pinEntry(int32 cluster, bool load, const char* data);
+    Entry* victim(Shard& shard);
+    void writeBack(Entry* entry);
+    uint64 offset(int32 cluster) { return dataStart + (uint64)cluster*clusterSize; }
+
+    ImageIO* image;
+    uint64 dataStart;
+    uint32 clusterSize;
+    size_t shardCapacity;
+    Shard shards[SHARDS];
+
+    std::atomic<uint64> hitCount;
+    std::atomic<uint64> missCount;
+    std::atomic<uint64> writebackCount;
+    std::atomic<uint64> evictionCount;
+};
@@ -0,0 +1,250 @@
+#include "fatscan.h"
+#include "FAT.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FATSCAN_X86
+#include <immintrin.h>
+#endif
+
+// Scalar versions, also used for tails shorter than one vector
+static void unusedBitsScalar(const int32* table, int32 from, int32 count, uint64* bits)
+{
+    for (int32 i = from; i < count; i++)
+        if (table[i] == FAT_UNUSED)
+            bits[i >> 6] |= 1ULL << (i & 63);
+}
+
+static void countEntriesScalar(const int32* table, int32 from, int32 count, FatCounts& counts)
+{
+    for (int32 i = from; i < count; i++)
+    {
+        switch (table[i])
+        {
+            case FAT_UNUSED: counts.unused++; break;
+            case FAT_DIRECTORY: counts.directory++; break;
+            case FAT_BAD_CLUSTER: counts.bad++; break;
+            case FAT_FILE_END: counts.fileEnd++; break;
+            default: counts.next++; break;
+        }
+    }
+}
+
+static int32 compareTablesScalar(const int32* a, const int32* b, int32 from, int32 count)
+{
+    for (int32 i = from; i < count; i++)
+        if (a[i] != b[i])
+            return i;
+    return -1;
+}
+
+#ifdef FATSCAN_X86
+// Whole words of bitmap are built from masks of compares
+static void unusedBitsSSE2(const int32* table, int32 count, uint64* bits)
+{
+    const __m128i unused = _mm_set1_epi32(FAT_UNUSED);
+    int32 i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        uint64 word = 0;
+        for (int32 j = 0; j < 64; j += 4)
+        {
+            __m128i values = _mm_loadu_si128((const __m128i*)(table + i + j));
+            word |= (uint64)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, unused))) << j;
+        }
+        bits[i >> 6] = word;
+    }
+    unusedBitsScalar(table, i, count, bits);
+}
+
+static void countEntriesSSE2(const int32* table, int32 count, FatCounts& counts)
+{
+    const __m128i unused = _mm_set1_epi32(FAT_UNUSED);
+    const __m128i directory = _mm_set1_epi32(FAT_DIRECTORY);
+    const __m128i bad = _mm_set1_epi32(FAT_BAD_CLUSTER);
+    const __m128i fileEnd = _mm_set1_epi32(FAT_FILE_END);
+    // Matching lanes are -1, subtracting them counts matches in every lane
+    __m128i sums[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+    int32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i values = _mm_loadu_si128((const __m128i*)(table + i));
+        sums[0] = _mm_sub_epi32(sums[0], _mm_cmpeq_epi32(values, unused));
+        sums[1] = _mm_sub_epi32(sums[1], _mm_cmpeq_epi32(values, directory));
+        sums[2] = _mm_sub_epi32(sums[2], _mm_cmpeq_epi32(values, bad));
+        sums[3] = _mm_sub_epi32(sums[3], _mm_cmpeq_epi32(values, fileEnd));
+    }
+    uint64 totals[4] = { 0, 0, 0, 0 };
+    for (int k = 0; k < 4; k++)
+    {
+        uint32 lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, sums[k]);
+        totals[k] = (uint64)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    counts.unused += totals[0];
+    counts.directory += totals[1];
+    counts.bad += totals[2];
+    counts.fileEnd += totals[3];
+    counts.next += i - totals[0] - totals[1] - totals[2] - totals[3];
+    countEntriesScalar(table, i, count, counts);
+}
+
+static int32 compareTablesSSE2(const int32* a, const int32* b, int32 count)
+{
+    int32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(va, vb)));
+        if (mask != 0xF)
+            return i + __builtin_ctz(~mask);
+    }
+    return compareTablesScalar(a, b, i, count);
+}
+
+__attribute__((target("avx2")))
+static void unusedBitsAVX2(const int32* table, int32 count, uint64* bits)
+{
+    const __m256i unused = _mm256_set1_epi32(FAT_UNUSED);
+    int32 i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        uint64 word = 0;
+        for (int32 j = 0; j < 64; j += 8)
+        {
+            __m256i values = _mm256_loadu_si256((const __m256i*)(table + i + j));
+            word |= (uint64)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(values, unused))) << j;
+        }
+        bits[i >> 6] = word;
+    }
+    unusedBitsScalar(table, i, count, bits);
+}
+
+__attribute__((target("avx2")))
+static void countEntriesAVX2(const int32* table, int32 count, FatCounts& counts)
+{
+    const __m256i unused = _mm256_set1_epi32(FAT_UNUSED);
+    const __m256i directory = _mm256_set1_epi32(FAT_DIRECTORY);
+    const __m256i bad = _mm256_set1_epi32(FAT_BAD_CLUSTER);
+    const __m256i fileEnd = _mm256_set1_epi32(FAT_FILE_END);
+    __m256i sums[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    int32 i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i values = _mm256_loadu_si256((const __m256i*)(table + i));
+        sums[0] = _mm256_sub_epi32(sums[0], _mm256_cmpeq_epi32(values, unused));
+        sums[1] = _mm256_sub_epi32(sums[1], _mm256_cmpeq_epi32(values, directory));
+        sums[2] = _mm256_sub_epi32(sums[2], _mm256_cmpeq_epi32(values, bad));
+        sums[3] = _mm256_sub_epi32(sums[3], _mm256_cmpeq_epi32(values, fileEnd));
+    }
+    uint64 totals[4] = { 0, 0, 0, 0 };
+    for (int k = 0; k < 4; k++)
+    {
+        uint32 lanes[8];
+        _mm256_storeu_si256((__m256i*)lanes, sums[k]);
+        for (int lane = 0; lane < 8; lane++)
+            totals[k] += lanes[lane];
+    }
+    counts.unused += totals[0];
+    counts.directory += totals[1];
+    counts.bad += totals[2];
+    counts.fileEnd += totals[3];
+    counts.next += i - totals[0] - totals[1] - totals[2] - totals[3];
+    countEntriesScalar(table, i, count, counts);
+}
+
+__attribute__((target("avx2")))
+static int32 compareTablesAVX2(const int32* a, const int32* b, int32 count)
+{
+    int32 i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vb)));
+        if (mask != 0xFF)
+            return i + __builtin_ctz(~mask);
+    }
+    return compareTablesScalar(a, b, i, count);
+}
+#endif
+
+static void unusedBitsPlain(const int32* table, int32 count, uint64* bits)
+{
+    unusedBitsScalar(table, 0, count, bits);
+}
+
+static void countEntriesPlain(const int32* table, int32 count, FatCounts& counts)
+{
+    countEntriesScalar(table, 0, count, counts);
+}
+
+static int32 compareTablesPlain(const int32* a, const int32* b, int32 count)
+{
+    return compareTablesScalar(a, b, 0, count);
+}
+
+// Kernels picked once for cpu we run on
+struct ScanKernels
+{
+    void (*unusedBits)(const int32*, int32, uint64*);
+    void (*countEntries)(const int32*, int32, FatCounts&);
+    int32 (*compareTables)(const int32*, const int32*, int32);
+    const char* name;
+
+    ScanKernels()
+        : unusedBits(unusedBitsPlain)
+        , countEntries(countEntriesPlain)
+        , compareTables(compareTablesPlain)
+        , name("scalar")
+    {
+#ifdef FATSCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            unusedBits = unusedBitsAVX2;
+            countEntries = countEntriesAVX2;
+            compareTables = compareTablesAVX2;
+            name = "avx2";
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            unusedBits = unusedBitsSSE2;
+            countEntries = countEntriesSSE2;
+            compareTables = compareTablesSSE2;
+            name = "sse2";
+        }
+#endif
+    }
+};
+
+static ScanKernels& kernels()
+{
+    static ScanKernels instance;
+    return instance;
+}
+
+// Set bit of every FAT_UNUSED entry in bitmap, bits must be zeroed and have (count + 63) / 64 words
+void unusedBits(const int32* table, int32 count, uint64* bits)
+{
+    kernels().unusedBits(table, count, bits);
+}
+
+// Add numbers of entries of every type to counts
+void countEntries(const int32* table, int32 count, FatCounts& counts)
+{
+    kernels().countEntries(table, count, counts);
+}
+
+// Find first index where tables differ, -1 if they are same
+int32 compareTables(const int32* a, const int32* b, int32 count)
+{
+    return kernels().compareTables(a, b, count);
+}
+
+const char* scanKernelName()
+{
+    return kernels().name;
+}
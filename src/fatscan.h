@@ -0,0 +1,19 @@
+#pragma once
+#include "util.h"
+
+// Number of fat entries of each type
+struct FatCounts
+{
+    uint64 unused;
+    uint64 directory;
+    uint64 bad;
+    uint64 fileEnd;
+    // Entries pointing to next cluster of chain
+    uint64 next;
+};
+
+// Scanning kernels over fat table, fastest available implementation (AVX2, SSE2 or scalar) is chosen at runtime
+void unusedBits(const int32* table, int32 count, uint64* bits);
+void countEntries(const int32* table, int32 count, FatCounts& counts);
+int32 compareTables(const int32* a, const int32* b, int32 count);
+const char* scanKernelName();
@@ -1,25 +1,129 @@
 #include "fs.h"
+#include "path.h"
 
+#include <algorithm>
+#include <cstring>
 
-Node::Node(std::string _name, int32 _cluster, bool _isFile, int32 _size, Node* _parent)
-    : name(_name)
-    , cluster(_cluster)
-    , isFile(_isFile)
+enum
+{
+    // Smaller dirs are searched linearly, its faster than hashing
+    INDEX_THRESHOLD = 16
+};
+
+
+Node::Node(const char* _name, int32 _cluster, bool _isFile, int32 _size, Node* _parent)
+    : isFile(_isFile)
+    , loaded(false)
     , size(_size)
+    , cluster(_cluster)
     , parent(_parent)
+    , slot(-1)
+    , freeSlot(0)
 {
+    strncpy(name, _name, 12);
+    name[12] = 0;
+    nameLength = (uint8)strlen(name);
+}
 
+// Add child, dir is filled only by thread which loads it so no locking is needed
+void Node::addChild(Node* child, NodeArena& arena)
+{
+    childs.push_back(child, arena);
+    if (!index.empty())
+        indexChild(child, arena);
+    else if (childs.size() >= INDEX_THRESHOLD)
+        buildIndex(arena);
 }
 
-Node::~Node()
+// Remove child from childs and index, child is not deleted
+void Node::removeChild(Node* child)
 {
-    for (auto node : childs)
-        delete node;
+    auto itr = std::find(childs.begin(), childs.end(), child);
+    if (itr == childs.end())
+        return;
+    childs.erase(itr);
+    if (index.empty())
+        return;
+
+    // Backward shift deletion, move following entries into hole unless they would get before their home slot
+    size_t mask = index.size() - 1;
+    size_t hole = indexSlot(child);
+    size_t next = hole;
+    while (true)
+    {
+        next = (next + 1) & mask;
+        if (!index[next])
+            break;
+        size_t home = hashName(index[next]->name, index[next]->nameLength) & mask;
+        bool between = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (between)
+            continue;
+        index[hole] = index[next];
+        hole = next;
+    }
+    index[hole] = nullptr;
+}
+
+// Find child by name, name doesnt need to be terminated
+Node* Node::findChild(const char* name, size_t size)
+{
+    if (index.empty())
+    {
+        for (auto child : childs)
+            if (child->nameLength == size && memcmp(child->name, name, size) == 0)
+                return child;
+        return nullptr;
+    }
+
+    size_t mask = index.size() - 1;
+    for (size_t slot = hashName(name, size) & mask; index[slot]; slot = (slot + 1) & mask)
+    {
+        Node* child = index[slot];
+        if (child->nameLength == size && memcmp(child->name, name, size) == 0)
+            return child;
+    }
+    return nullptr;
+}
+
+// Insert child into index, grow index so it stays at most half full
+void Node::indexChild(Node* child, NodeArena& arena)
+{
+    if (childs.size() * 2 > index.size())
+    {
+        buildIndex(arena);
+        return;
+    }
+    size_t mask = index.size() - 1;
+    size_t slot = hashName(child->name, child->nameLength) & mask;
+    while (index[slot])
+        slot = (slot + 1) & mask;
+    index[slot] = child;
+}
+
+// Build index from all childs
+void Node::buildIndex(NodeArena& arena)
+{
+    size_t size = INDEX_THRESHOLD * 2;
+    while (size < childs.size() * 4)
+        size *= 2;
+    index.fill(size, nullptr, arena);
+
+    size_t mask = size - 1;
+    for (auto child : childs)
+    {
+        size_t slot = hashName(child->name, child->nameLength) & mask;
+        while (index[slot])
+            slot = (slot + 1) & mask;
+        index[slot] = child;
+    }
 }
 
-// Secure add children from multiple threads
-void Node::addChild(Node* child)
+// Slot of child in index
+size_t Node::indexSlot(Node* child)
 {
-    Guard guard(_lock);
-    childs.push_back(child);
+    size_t mask = index.size() - 1;
+    size_t slot = hashName(child->name, child->nameLength) & mask;
+    while (index[slot] != child)
+        slot = (slot + 1) & mask;
+    return slot;
 }
@@ -1,23 +1,43 @@
 #pragma once
 #include "util.h"
-#include <string>
-#include <vector>
+#include "arena.h"
 
 
+// Entry of filesystem tree, lives in NodeArena of thread which created it and is never deleted alone
 class Node
 {
 public:
-    Node(std::string name, int32 cluster, bool isFile, int32 size, Node* _parent);
-    ~Node();
-    void addChild(Node* child);
+    Node(const char* name, int32 cluster, bool isFile, int32 size, Node* _parent);
+    void* operator new(size_t size, NodeArena& arena) { return arena.allocate(size); }
+    void operator delete(void*, NodeArena&) {}
 
-    std::string name;
-    Node* parent;
+    void addChild(Node* child, NodeArena& arena);
+    void removeChild(Node* child);
+    Node* findChild(const char* name, size_t size);
+
+    // Name is at most 12 characters by format, stored terminated
+    char name[13];
+    uint8 nameLength;
     bool isFile;
+    // Dir content was read from disk, in lazy mode dirs are read when path goes through them
+    bool loaded;
     int32 size;
     int32 cluster;
-    std::vector<Node*> childs;
+    Node* parent;
+    ArenaList<Node*> childs;
+    // Runs of clusters of file or dir, built from its chain when it is loaded
+    ArenaList<Extent> extents;
+    // Slot of entry in dir clusters of parent, -1 if node isnt in any dir
+    int32 slot;
+    // Childs of dir by their slot, every cluster of dir have maxDirs slots and nullptr is free slot
+    ArenaList<Node*> slots;
+    // There is no free slot before this one
+    uint32 freeSlot;
 private:
-    std::mutex _lock;
+    void indexChild(Node* child, NodeArena& arena);
+    void buildIndex(NodeArena& arena);
+    size_t indexSlot(Node* child);
 
+    // Hash table of childs with linear probing, built only when dir have many childs
+    ArenaList<Node*> index;
 };
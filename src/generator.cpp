@@ -0,0 +1,303 @@
+#include "generator.h"
+#include "FAT.h"
+#include "image.h"
+#include "path.h"
+
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <stdexcept>
+#include <cstdio>
+
+enum
+{
+    // Longest jump over free clusters when run of file is broken
+    FRAGMENT_GAP = 8,
+    // Most files and subdirs of one dir, FILE9999.DAT and DIR999999999 are longest names which fit into 12 characters
+    MAX_FILES = 10000,
+    MAX_SUBDIRS = 1000000000
+};
+
+GeneratorConfig::GeneratorConfig()
+    : filename("empty.fat")
+    , clusterCount(0)
+    , clusterSize(0)
+    , depth(0)
+    , fanout(0)
+    , files(0)
+    , fileSize(0)
+    , distribution(SIZE_FIXED)
+    , fragmentation(0)
+    , badRate(0)
+    , seed(0)
+    , hashed(false)
+{
+}
+
+Generator::Generator(const GeneratorConfig& _config)
+    : config(_config)
+    , fat(nullptr)
+    , image(nullptr)
+    , eng(_config.seed)
+    , cursor(1)
+    , nextBad(-1)
+    , failed(false)
+{
+    if (config.clusterCount <= 0 || config.clusterSize < (int16)sizeof(Directory))
+        throw std::runtime_error("Wrong cluster count or size!");
+    if (config.fragmentation > 100 || config.badRate > 1000)
+        throw std::runtime_error("Wrong fragmentation or bad cluster rate!");
+    if (config.files > MAX_FILES || config.fanout > MAX_SUBDIRS)
+        throw std::runtime_error("Too many files or subdirs for their names!");
+
+    // Same room for entries as fat will count when loading
+    maxDirs = config.clusterSize / sizeof(Directory);
+    if (config.clusterSize % sizeof(Directory) < 8)
+    {
+        if (maxDirs <= 1)
+            throw std::runtime_error("Not enough room for directories.");
+        maxDirs--;
+    }
+    dataStart = sizeof(BootRecord) + 2 * (uint64)config.clusterCount*sizeof(int32);
+}
+
+Generator::~Generator()
+{
+    delete[] fat;
+    delete image;
+}
+
+uint64 Generator::fileCount()
+{
+    uint64 count = 0;
+    for (auto& dir : dirs)
+        count += dir.sizes.size();
+    return count;
+}
+
+// Plan tree, allocate its clusters and write image
+void Generator::generate(uint8 workers)
+{
+    workers = std::max((uint8)1, workers);
+
+    // Tree skeleton level by level, every dir needs cluster so bigger tree cant fit
+    Dir root = Dir();
+    dirs.push_back(root);
+    size_t levelStart = 0;
+    for (uint32 level = 0; level < config.depth && config.fanout; level++)
+    {
+        size_t levelEnd = dirs.size();
+        if (levelEnd + (levelEnd - levelStart) * (uint64)config.fanout > (uint64)config.clusterCount)
+            throw std::runtime_error("Not enough disc space");
+        for (size_t i = levelStart; i < levelEnd; i++)
+        {
+            dirs[i].firstSubdir = (uint32)dirs.size();
+            dirs[i].subdirs = config.fanout;
+            dirs.resize(dirs.size() + config.fanout, root);
+        }
+        levelStart = levelEnd;
+    }
+
+    std::vector<std::thread*> threads;
+    for (uint8 i = 0; i < workers; i++)
+        threads.push_back(new std::thread(&Generator::planDirs, this, i, workers));
+    for (auto* thread : threads)
+    {
+        thread->join();
+        delete thread;
+    }
+    threads.clear();
+
+    allocate();
+
+    image = new ImageIO(config.filename, false, true);
+    if (!image->opened())
+        throw std::runtime_error("Cant create fat file!");
+    // Drop old content, then whole image is one hole which is filled only where something is written
+    if (!image->truncate(0) || !image->truncate(dataStart + (uint64)config.clusterCount*config.clusterSize))
+        throw std::runtime_error("Cant create fat file!");
+
+    BootRecord br;
+    memset(&br, 0, sizeof(BootRecord));
+    strcpy(br.volume_descriptor, "big empty fat");
+    strcpy(br.signature, "smartine");
+    br.cluster_size = config.clusterSize;
+    br.usable_cluster_count = config.clusterCount;
+    br.fat_type = 8;
+    br.fat_copies = 2;
+    if (image->write(&br, sizeof(BootRecord), 0) != sizeof(BootRecord))
+        throw std::runtime_error("Cant write boot record!");
+
+    for (uint8 i = 0; i < workers; i++)
+        threads.push_back(new std::thread(&Generator::writeImage, this, i, workers));
+    for (auto* thread : threads)
+    {
+        thread->join();
+        delete thread;
+    }
+    if (failed)
+        throw std::runtime_error("Cant write fat file!");
+}
+
+// Sizes of files of every worker-th dir, generator of dir is seeded from seed and dir number
+void Generator::planDirs(uint8 worker, uint8 workers)
+{
+    for (size_t i = worker; i < dirs.size(); i += workers)
+    {
+        std::seed_seq seq = { config.seed, (uint32)i };
+        std::mt19937 dirEng(seq);
+        std::uniform_int_distribution<uint64> uniform(0, 2 * (uint64)config.fileSize);
+        std::exponential_distribution<> exponential(config.fileSize ? 1.0 / config.fileSize : 1.0);
+
+        Dir& dir = dirs[i];
+        dir.sizes.resize(config.files);
+        dir.starts.resize(config.files);
+        for (auto& size : dir.sizes)
+        {
+            uint64 value = config.fileSize;
+            if (config.distribution == SIZE_UNIFORM)
+                value = uniform(dirEng);
+            else if (config.distribution == SIZE_EXPONENTIAL)
+                value = (uint64)exponential(dirEng);
+            size = (int32)std::min<uint64>(value, INT32_MAX);
+        }
+    }
+}
+
+// Give clusters to dirs and files in order they are in tree, clusters become bad as cursor goes over them
+void Generator::allocate()
+{
+    fat = new int32[config.clusterCount];
+    std::fill(fat, fat + config.clusterCount, (int32)FAT_UNUSED);
+    fat[0] = FAT_DIRECTORY;
+
+    std::geometric_distribution<int32> badDistance(config.badRate ? config.badRate / 1000.0 : 1.0);
+    nextBad = config.badRate ? cursor + badDistance(eng) : -1;
+
+    for (size_t i = 0; i < dirs.size(); i++)
+    {
+        // Root starts at cluster 0, its other clusters are taken as for any dir
+        Dir& dir = dirs[i];
+        // Hashed dir is left at most 3/4 full, so probe for any name ends in cluster with free slot
+        uint64 entries = dir.subdirs + (uint64)dir.sizes.size();
+        uint64 room = config.hashed ? (uint64)maxDirs * 3 : maxDirs;
+        uint32 parts = (uint32)std::max<uint64>(1, ((config.hashed ? entries * 4 : entries) + room - 1) / room);
+        for (uint32 j = 0; j < parts; j++)
+        {
+            int32 cluster = i || j ? takeCluster() : 0;
+            if (j)
+                fat[dir.clusters.back()] = cluster;
+            dir.clusters.push_back(cluster);
+        }
+        fat[dir.clusters.back()] = FAT_DIRECTORY;
+        for (size_t j = 0; j < dir.sizes.size(); j++)
+            allocateFile(dir, j);
+    }
+
+    // Rest of disc gets its bad clusters too
+    while (nextBad >= 0 && nextBad < config.clusterCount)
+    {
+        fat[nextBad] = FAT_BAD_CLUSTER;
+        nextBad += badDistance(eng) + 1;
+    }
+}
+
+// Next usable cluster at cursor, bad clusters on the way and in skipped gaps are marked
+int32 Generator::takeCluster()
+{
+    std::geometric_distribution<int32> badDistance(config.badRate ? config.badRate / 1000.0 : 1.0);
+    while (nextBad >= 0 && nextBad <= cursor)
+    {
+        fat[nextBad] = FAT_BAD_CLUSTER;
+        if (nextBad == cursor)
+            cursor++;
+        nextBad += badDistance(eng) + 1;
+    }
+    if (cursor >= config.clusterCount)
+        throw std::runtime_error("Not enough disc space");
+    return cursor++;
+}
+
+// Chain clusters of file, with fragmentation run is broken and free clusters are skipped
+void Generator::allocateFile(Dir& dir, size_t file)
+{
+    std::bernoulli_distribution broken(config.fragmentation / 100.0);
+    std::uniform_int_distribution<int32> gap(1, FRAGMENT_GAP);
+
+    // Even empty file needs its start cluster
+    int32 nrCluster = std::max(1, dir.sizes[file] / config.clusterSize + !!(dir.sizes[file] % config.clusterSize));
+    int32 prev = takeCluster();
+    dir.starts[file] = prev;
+    for (int32 i = 1; i < nrCluster; i++)
+    {
+        if (config.fragmentation && broken(eng))
+            cursor = (int32)std::min<int64_t>((int64_t)cursor + gap(eng), config.clusterCount);
+        int32 cluster = takeCluster();
+        fat[prev] = cluster;
+        prev = cluster;
+    }
+    fat[prev] = FAT_FILE_END;
+}
+
+// Write every worker-th piece of fat tables and clusters of every worker-th dir, empty dirs stay as holes
+void Generator::writeImage(uint8 worker, uint8 workers)
+{
+    size_t tableSize = sizeof(int32)*config.clusterCount;
+    size_t pieces = (tableSize + IMPORT_CHUNK - 1) / IMPORT_CHUNK;
+    for (size_t i = worker; i < 2 * pieces && !failed; i += workers)
+    {
+        size_t start = (i % pieces) * IMPORT_CHUNK;
+        size_t size = std::min<size_t>(IMPORT_CHUNK, tableSize - start);
+        uint64 offset = sizeof(BootRecord) + (i / pieces) * (uint64)tableSize + start;
+        if (image->write((char*)fat + start, size, offset) != size)
+            failed = true;
+    }
+
+    std::vector<char> buffer;
+    for (size_t i = worker; i < dirs.size() && !failed; i += workers)
+    {
+        Dir& dir = dirs[i];
+        if (!dir.subdirs && dir.sizes.empty())
+            continue;
+        buffer.assign(dir.clusters.size() * config.clusterSize, 0);
+        // Entries fill clusters of chain one after other or by hash of name, rest of every cluster stays empty
+        std::vector<uint32> fill(dir.clusters.size(), 0);
+        uint32 entries = 0;
+        for (uint32 j = 0; j < dir.subdirs; j++, entries++)
+        {
+            Directory entry;
+            memset(&entry, 0, sizeof(Directory));
+            // Name is formatted into bigger buffer, limits in constructor make it fit
+            char name[24] = { 0 };
+            snprintf(name, sizeof(name), "DIR%u", j);
+            memcpy(entry.name, name, sizeof(entry.name) - 1);
+            entry.start_cluster = dirs[dir.firstSubdir + j].clusters[0];
+            memcpy(&buffer[entryOffset(fill, entries, entry.name)], &entry, sizeof(Directory));
+        }
+        for (size_t j = 0; j < dir.sizes.size(); j++, entries++)
+        {
+            Directory entry;
+            memset(&entry, 0, sizeof(Directory));
+            char name[24] = { 0 };
+            snprintf(name, sizeof(name), "FILE%u.DAT", (uint32)j);
+            memcpy(entry.name, name, sizeof(entry.name) - 1);
+            entry.isFile = true;
+            entry.size = dir.sizes[j];
+            entry.start_cluster = dir.starts[j];
+            memcpy(&buffer[entryOffset(fill, entries, entry.name)], &entry, sizeof(Directory));
+        }
+        for (size_t j = 0; j < dir.clusters.size() && !failed; j++)
+            if (image->write(&buffer[j * config.clusterSize], config.clusterSize, dataStart + (uint64)dir.clusters[j]*config.clusterSize) != (size_t)config.clusterSize)
+                failed = true;
+    }
+}
+
+// Offset of next entry in buffer of dir, linear dir fills clusters in order, hashed one takes first cluster with room from home cluster of name
+size_t Generator::entryOffset(std::vector<uint32>& fill, uint32 entry, const char* name)
+{
+    uint32 parts = (uint32)fill.size();
+    uint32 part = config.hashed ? hashName(name, strlen(name)) % parts : entry / maxDirs;
+    while (fill[part] == maxDirs)
+        part = (part + 1) % parts;
+    return part * config.clusterSize + fill[part]++ * sizeof(Directory);
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "util.h"
+#include <string>
+#include <vector>
+#include <random>
+#include <atomic>
+
+class ImageIO;
+
+enum sizeDistributions : uint8
+{
+    SIZE_FIXED,
+    // Uniform between zero and twice of mean size
+    SIZE_UNIFORM,
+    SIZE_EXPONENTIAL,
+};
+
+// Shape of generated fat, default is empty fat with only root dir
+struct GeneratorConfig
+{
+    GeneratorConfig();
+
+    std::string filename;
+    int32 clusterCount;
+    int16 clusterSize;
+    // Levels of dirs under root and number of subdirs in every dir
+    uint32 depth;
+    uint32 fanout;
+    // Files in every dir including root, their mean size in bytes
+    uint32 files;
+    uint32 fileSize;
+    uint8 distribution;
+    // Percent chance that run of file is broken after cluster
+    uint32 fragmentation;
+    // Clusters marked bad per mille
+    uint32 badRate;
+    uint32 seed;
+    // Entries are placed by hash of name, as FAT does with --hashed-dirs
+    bool hashed;
+};
+
+// Generator of big fat images. Data part is left sparse so only dir clusters and fat tables are written.
+// Content of every dir is planned from its own seed, so image is same for any number of threads.
+class Generator
+{
+public:
+    Generator(const GeneratorConfig& config);
+    ~Generator();
+
+    void generate(uint8 workers);
+    size_t dirCount() { return dirs.size(); }
+    uint64 fileCount();
+private:
+    struct Dir
+    {
+        // Chain of dir clusters, dir with more entries than fit into one cluster have more of them
+        std::vector<int32> clusters;
+        // Subdirs are numbered in breadth first order, so subdirs of every dir follows each other
+        uint32 firstSubdir;
+        uint32 subdirs;
+        std::vector<int32> sizes;
+        std::vector<int32> starts;
+    };
+
+    void planDirs(uint8 worker, uint8 workers);
+    void allocate();
+    int32 takeCluster();
+    void allocateFile(Dir& dir, size_t file);
+    void writeImage(uint8 worker, uint8 workers);
+    size_t entryOffset(std::vector<uint32>& fill, uint32 entry, const char* name);
+
+    GeneratorConfig config;
+    uint32 maxDirs;
+    uint64 dataStart;
+    std::vector<Dir> dirs;
+    int32* fat;
+    ImageIO* image;
+
+    // Allocation state, only used by allocate
+    std::mt19937 eng;
+    int32 cursor;
+    int64_t nextBad;
+    std::atomic<bool> failed;
+};
@@ -0,0 +1,333 @@
+#include "image.h"
+
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <climits>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <cerrno>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#endif
+
+// Open file, check opened() to see if it succeeded, with create missing file is created but existing one is kept
+ImageIO::ImageIO(std::string filename, bool _readOnly, bool create)
+    : readOnly(_readOnly)
+    , mapping(nullptr)
+    , mappingSize(0)
+{
+#ifdef _WIN32
+    fd = _open(filename.c_str(), (readOnly ? _O_RDONLY : _O_RDWR) | (create ? _O_CREAT : 0) | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    fd = open(filename.c_str(), (readOnly ? O_RDONLY : O_RDWR) | (create ? O_CREAT : 0), 0644);
+#endif
+}
+
+ImageIO::~ImageIO()
+{
+    if (fd < 0)
+        return;
+#ifdef _WIN32
+    _close(fd);
+#else
+    if (mapping)
+        munmap(mapping, mappingSize);
+    close(fd);
+#endif
+}
+
+// Read size bytes from offset, returns number of bytes actually read
+size_t ImageIO::read(void* buffer, size_t size, uint64 offset)
+{
+    char* out = (char*)buffer;
+    size_t done = 0;
+    if (mapping)
+    {
+        done = offset < mappingSize ? (size_t)std::min<uint64>(size, mappingSize - offset) : 0;
+        memcpy(out, mapping + offset, done);
+        return done;
+    }
+#ifdef _WIN32
+    Guard guard(lock);
+    if (_lseeki64(fd, offset, SEEK_SET) < 0)
+        return 0;
+    while (done < size)
+    {
+        int res = _read(fd, out + done, (unsigned int)(size - done));
+        if (res <= 0)
+            break;
+        done += res;
+    }
+#else
+    // pread can return less than asked, keep reading until we got everything or hit end of file
+    while (done < size)
+    {
+        ssize_t res = pread(fd, out + done, size - done, offset + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        done += res;
+    }
+#endif
+    return done;
+}
+
+// Write size bytes to offset, returns number of bytes actually written
+size_t ImageIO::write(const void* buffer, size_t size, uint64 offset)
+{
+    const char* in = (const char*)buffer;
+    size_t done = 0;
+    if (mapping)
+    {
+        done = offset < mappingSize ? (size_t)std::min<uint64>(size, mappingSize - offset) : 0;
+        // Source can be view into same mapping (cluster moved inside fat file)
+        memmove(mapping + offset, in, done);
+        return done;
+    }
+#ifdef _WIN32
+    Guard guard(lock);
+    if (_lseeki64(fd, offset, SEEK_SET) < 0)
+        return 0;
+    while (done < size)
+    {
+        int res = _write(fd, in + done, (unsigned int)(size - done));
+        if (res <= 0)
+            break;
+        done += res;
+    }
+#else
+    while (done < size)
+    {
+        ssize_t res = pwrite(fd, in + done, size - done, offset + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        done += res;
+    }
+#endif
+    return done;
+}
+
+// Write buffers one after another from offset with one call, returns number of bytes actually written
+size_t ImageIO::write(const IoBuffer* buffers, size_t count, uint64 offset)
+{
+    size_t done = 0;
+#ifndef _WIN32
+    if (!mapping)
+    {
+        std::vector<struct iovec> iov(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            iov[i].iov_base = (void*)buffers[i].data;
+            iov[i].iov_len = buffers[i].size;
+        }
+
+        size_t first = 0;
+        while (first < count)
+        {
+            ssize_t res = pwritev(fd, &iov[first], (int)std::min<size_t>(count - first, IOV_MAX), offset + done);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                break;
+            done += res;
+            // Skip written buffers and continue in middle of partially written one
+            while (first < count && (size_t)res >= iov[first].iov_len)
+                res -= iov[first++].iov_len;
+            if (first < count)
+            {
+                iov[first].iov_base = (char*)iov[first].iov_base + res;
+                iov[first].iov_len -= res;
+            }
+        }
+        return done;
+    }
+#endif
+    // Mapping and platforms without pwritev just copy buffers one by one
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t res = write(buffers[i].data, buffers[i].size, offset + done);
+        done += res;
+        if (res != buffers[i].size)
+            break;
+    }
+    return done;
+}
+
+// Size of fat file in bytes
+uint64 ImageIO::size()
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_fstat64(fd, &st))
+        return 0;
+#else
+    struct stat st;
+    if (fstat(fd, &st))
+        return 0;
+#endif
+    return st.st_size;
+}
+
+// Create or truncate file on host for writing, returns descriptor or -1
+int ImageIO::createFile(const std::string& filename)
+{
+#ifdef _WIN32
+    return _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+void ImageIO::closeFile(int fd)
+{
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Copy size bytes from offset to another descriptor, kernel copies them when it can so data dont go through user space
+uint64 ImageIO::copyTo(int outFd, uint64 offset, uint64 size)
+{
+    uint64 done = 0;
+#ifndef _WIN32
+    if (mapping)
+    {
+        // Mapping already is in memory, just write it out
+        while (done < size && offset + done < mappingSize)
+        {
+            ssize_t res = ::write(outFd, mapping + offset + done, (size_t)std::min<uint64>(size - done, mappingSize - offset - done));
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                break;
+            done += res;
+        }
+        return done;
+    }
+#endif
+#ifdef __linux__
+    // Between regular files, can be even reflink or server side copy
+    while (done < size)
+    {
+        loff_t in = offset + done;
+        ssize_t res = copy_file_range(fd, &in, outFd, nullptr, size - done, 0);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        done += res;
+    }
+    // Works also for pipes and terminals
+    while (done < size)
+    {
+        off_t in = offset + done;
+        ssize_t res = sendfile(outFd, fd, &in, size - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        done += res;
+    }
+#endif
+    // Plain copy through buffer when kernel cant do it
+    std::vector<char> buffer((size_t)std::min<uint64>(size - done, 1 << 20));
+    while (done < size)
+    {
+        size_t chunk = read(buffer.data(), (size_t)std::min<uint64>(size - done, buffer.size()), offset + done);
+        if (!chunk)
+            break;
+        for (size_t written = 0; written < chunk; )
+        {
+#ifdef _WIN32
+            int res = _write(outFd, buffer.data() + written, (unsigned int)(chunk - written));
+#else
+            ssize_t res = ::write(outFd, buffer.data() + written, chunk - written);
+#endif
+            if (res <= 0)
+                return done + written;
+            written += res;
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+// Map whole fat file into memory, reads and writes then become plain copies from/into the mapping
+bool ImageIO::map()
+{
+#ifdef _WIN32
+    return false;
+#else
+    if (mapping)
+        return true;
+    mappingSize = size();
+    if (!mappingSize)
+        return false;
+    void* res = mmap(nullptr, mappingSize, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (res == MAP_FAILED)
+        return false;
+    mapping = (char*)res;
+    return true;
+#endif
+}
+
+// Make written data durable
+bool ImageIO::sync()
+{
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#else
+    if (mapping && msync(mapping, mappingSize, MS_SYNC))
+        return false;
+#ifdef __linux__
+    return fdatasync(fd) == 0;
+#else
+    return fsync(fd) == 0;
+#endif
+#endif
+}
+
+bool ImageIO::truncate(uint64 size)
+{
+#ifdef _WIN32
+    return _chsize_s(fd, size) == 0;
+#else
+    return ftruncate(fd, size) == 0;
+#endif
+}
+
+// Hint that range will be read soon so kernel starts reading it in background
+void ImageIO::prefetch(uint64 offset, uint64 size)
+{
+#ifndef _WIN32
+    if (mapping)
+    {
+        // Advice works on whole pages
+        uint64 page = sysconf(_SC_PAGESIZE);
+        uint64 start = offset & ~(page - 1);
+        uint64 end = std::min(offset + size, mappingSize);
+        if (start < end)
+            madvise(mapping + start, end - start, MADV_WILLNEED);
+        return;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+#endif
+}
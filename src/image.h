@@ -0,0 +1,45 @@
+#pragma once
+#include "util.h"
+#include <string>
+
+// Part of data written by vectored write
+struct IoBuffer
+{
+    const void* data;
+    size_t size;
+};
+
+// Positional I/O on raw descriptor of fat file, every call carries its own offset so threads dont share file position
+class ImageIO
+{
+public:
+    ImageIO(std::string filename, bool readOnly = false, bool create = false);
+    ~ImageIO();
+    bool opened() { return fd >= 0; }
+    int descriptor() { return fd; }
+
+    size_t read(void* buffer, size_t size, uint64 offset);
+    size_t write(const void* buffer, size_t size, uint64 offset);
+    size_t write(const IoBuffer* buffers, size_t count, uint64 offset);
+    uint64 size();
+    void prefetch(uint64 offset, uint64 size);
+    bool sync();
+    bool truncate(uint64 size);
+
+    uint64 copyTo(int outFd, uint64 offset, uint64 size);
+    static int createFile(const std::string& filename);
+    static void closeFile(int fd);
+
+    bool map();
+    // Start of memory mapped fat file or nullptr when not mapped
+    char* data() { return mapping; }
+private:
+    int fd;
+    bool readOnly;
+    char* mapping;
+    uint64 mappingSize;
+#ifdef _WIN32
+    // Windows CRT have no pread/pwrite, fall back to seek + read under lock
+    std::mutex lock;
+#endif
+};
@@ -0,0 +1,160 @@
+#include "journal.h"
+#include "image.h"
+
+#include <cstring>
+#include <stdexcept>
+
+enum
+{
+    JOURNAL_MAGIC = 0x4c4e524a,
+    // Journal is checkpointed when it grows over this size
+    JOURNAL_CHECKPOINT = 4 << 20
+};
+
+// FNV-1a over header and data
+static uint32 checksum(const JournalRecord& header, const char* data)
+{
+    JournalRecord copy = header;
+    copy.checksum = 0;
+    uint32 hash = 2166136261u;
+    const char* bytes = (const char*)&copy;
+    for (size_t i = 0; i < sizeof(copy); i++)
+        hash = (hash ^ (uint8)bytes[i]) * 16777619u;
+    for (size_t i = 0; i < header.size; i++)
+        hash = (hash ^ (uint8)data[i]) * 16777619u;
+    return hash;
+}
+
+Journal::Journal(ImageIO* _image, const std::string& filename, bool create)
+    : image(_image)
+    , file(new ImageIO(filename, false, create))
+    , records(0)
+    , sequence(1)
+    , size(0)
+{
+}
+
+Journal::~Journal()
+{
+    delete file;
+}
+
+bool Journal::opened()
+{
+    return file->opened();
+}
+
+// Write every committed transaction into fat file and empty journal, unfinished transaction at end is dropped
+uint32 Journal::replay()
+{
+    std::vector<char> content((size_t)file->size());
+    if (content.empty())
+        return 0;
+    if (file->read(content.data(), content.size(), 0) != content.size())
+        throw std::runtime_error("Cant read journal!");
+
+    uint32 applied = 0;
+    size_t start = 0;
+    size_t pos = 0;
+    uint32 count = 0;
+    while (pos + sizeof(JournalRecord) <= content.size())
+    {
+        JournalRecord header;
+        memcpy(&header, &content[pos], sizeof(header));
+        const char* data = &content[pos + sizeof(header)];
+        if (header.magic != JOURNAL_MAGIC || header.size > content.size() - pos - sizeof(header) || header.checksum != checksum(header, data))
+            break;
+        pos += sizeof(header) + header.size;
+        if (header.type != JOURNAL_COMMIT)
+        {
+            count++;
+            continue;
+        }
+        if (header.offset != count)
+            break;
+
+        // Transaction is complete, write its records in place
+        for (size_t itr = start; itr < pos - sizeof(header); )
+        {
+            JournalRecord record;
+            memcpy(&record, &content[itr], sizeof(record));
+            if (image->write(&content[itr + sizeof(record)], record.size, record.offset) != record.size)
+                throw std::runtime_error("Cant replay journal!");
+            itr += sizeof(record) + record.size;
+        }
+        applied++;
+        start = pos;
+        count = 0;
+    }
+    checkpoint();
+    return applied;
+}
+
+// Add change into open transaction
+void Journal::add(uint32 type, const void* data, size_t size, uint64 offset)
+{
+    append(type, data, size, offset);
+    records++;
+}
+
+void Journal::append(uint32 type, const void* data, size_t dataSize, uint64 offset)
+{
+    JournalRecord header;
+    header.magic = JOURNAL_MAGIC;
+    header.type = type;
+    header.sequence = sequence;
+    header.offset = offset;
+    header.size = (uint32)dataSize;
+    header.checksum = checksum(header, (const char*)data);
+
+    size_t pos = transaction.size();
+    transaction.resize(pos + sizeof(header) + dataSize);
+    memcpy(&transaction[pos], &header, sizeof(header));
+    if (dataSize)
+        memcpy(&transaction[pos + sizeof(header)], data, dataSize);
+}
+
+// Make open transaction durable in journal and then write it in place
+void Journal::commit()
+{
+    if (!records)
+        return;
+    // Data clusters must be on disk before metadata which points to them
+    if (!image->sync())
+        throw std::runtime_error("Cant sync fat file!");
+    append(JOURNAL_COMMIT, nullptr, 0, records);
+    if (file->write(transaction.data(), transaction.size(), size) != transaction.size() || !file->sync())
+        throw std::runtime_error("Cant write journal!");
+
+    // Once journal have transaction crash can only repeat these writes
+    for (size_t pos = 0; pos < transaction.size(); )
+    {
+        JournalRecord record;
+        memcpy(&record, &transaction[pos], sizeof(record));
+        if (record.type != JOURNAL_COMMIT && image->write(&transaction[pos + sizeof(record)], record.size, record.offset) != record.size)
+            throw std::runtime_error("Cant update fat file!");
+        pos += sizeof(record) + record.size;
+    }
+
+    size += transaction.size();
+    transaction.clear();
+    records = 0;
+    sequence++;
+    if (size >= JOURNAL_CHECKPOINT)
+        checkpoint();
+}
+
+// Drop open transaction, nothing of it was written yet
+void Journal::abort()
+{
+    transaction.clear();
+    records = 0;
+}
+
+// Sync in place writes so journal is not needed anymore and empty it
+void Journal::checkpoint()
+{
+    if (!image->sync() || !file->truncate(0) || !file->sync())
+        throw std::runtime_error("Cant checkpoint journal!");
+    size = 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "util.h"
+#include <string>
+#include <vector>
+
+class ImageIO;
+
+enum journalRecordTypes : uint32
+{
+    JOURNAL_FAT = 1,
+    JOURNAL_DIR,
+    // Ends transaction, offset holds number of its records
+    JOURNAL_COMMIT,
+};
+
+// Header of every journal record, size bytes of data written at offset of fat file follow it
+struct JournalRecord
+{
+    uint32 magic;
+    uint32 type;
+    uint64 sequence;
+    uint64 offset;
+    uint32 size;
+    // Checksum of header with zero checksum and data
+    uint32 checksum;
+};
+
+// Write-ahead journal of metadata kept in sidecar file, changes are collected into transaction which is appended and synced
+// as a whole on commit, then written in place. Journal is emptied on checkpoint after fat file was synced.
+class Journal
+{
+public:
+    Journal(ImageIO* image, const std::string& filename, bool create);
+    ~Journal();
+    bool opened();
+
+    uint32 replay();
+    void add(uint32 type, const void* data, size_t size, uint64 offset);
+    void commit();
+    void abort();
+    void checkpoint();
+private:
+    void append(uint32 type, const void* data, size_t size, uint64 offset);
+
+    ImageIO* image;
+    ImageIO* file;
+    // Records of open transaction
+    std::vector<char> transaction;
+    uint32 records;
+    uint64 sequence;
+    // Bytes committed since last checkpoint
+    uint64 size;
+};
@@ -1,43 +1,148 @@
 #include <iostream>
 #include "FAT.h"
+#include "generator.h"
+#include "stats.h"
+#include "trace.h"
 #include <cstring>
 #include <algorithm>
 #include <random>
 #include "util.h"
 
-void create(int16 cluster_count, int16 cluster_size)
-{
-    FILE *file = fopen("empty.fat", "wb");
-
-    // boot record
-    BootRecord br;
-    memset(&br, 0, sizeof(BootRecord));
-    strcpy(br.volume_descriptor, "big empty fat");
-    strcpy(br.signature, "smartine");
-    br.cluster_size = cluster_size;
-    br.usable_cluster_count = cluster_count;
-    br.fat_type = 8;
-    br.fat_copies = 2;
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cerrno>
 
-    char* cluster = new char[cluster_size];
-    memset(cluster, 0, cluster_size);
+// Parse decimal number not bigger than max, sign or anything after number is error
+bool parseNumber(const char* value, uint64 max, uint32& number)
+{
+    if (*value < '0' || *value > '9')
+        return false;
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (*end || errno || parsed > max)
+        return false;
+    number = (uint32)parsed;
+    return true;
+}
 
-    int32* fat = new int32[cluster_count];
-    for (int32 i = 0; i < cluster_count; i++)
-        fat[i] = FAT_UNUSED;
+// Parse key=value option of generator, false if it is not known or its value is wrong
+bool parseGeneratorOption(GeneratorConfig& config, const char* option)
+{
+    const char* value = strchr(option, '=');
+    if (!value)
+        return false;
+    std::string key(option, value - option);
+    value++;
+    uint32 threads;
+    if (key == "file")
+        config.filename = value;
+    else if (key == "depth")
+        return parseNumber(value, UINT32_MAX, config.depth);
+    else if (key == "fanout")
+        return parseNumber(value, UINT32_MAX, config.fanout);
+    else if (key == "files")
+        return parseNumber(value, UINT32_MAX, config.files);
+    else if (key == "size")
+        return parseNumber(value, INT32_MAX, config.fileSize);
+    else if (key == "dist" && strcmp(value, "fixed") == 0)
+        config.distribution = SIZE_FIXED;
+    else if (key == "dist" && strcmp(value, "uniform") == 0)
+        config.distribution = SIZE_UNIFORM;
+    else if (key == "dist" && strcmp(value, "exp") == 0)
+        config.distribution = SIZE_EXPONENTIAL;
+    else if (key == "frag")
+        return parseNumber(value, UINT32_MAX, config.fragmentation);
+    else if (key == "bad")
+        return parseNumber(value, UINT32_MAX, config.badRate);
+    else if (key == "threads")
+    {
+        if (!parseNumber(value, UINT8_MAX, threads))
+            return false;
+        FAT::max_threads = std::max(threads, (uint32)1);
+    }
+    else if (key == "seed")
+        return parseNumber(value, UINT32_MAX, config.seed);
+    else if (key == "layout" && strcmp(value, "hashed") == 0)
+        config.hashed = true;
+    else if (key == "layout" && strcmp(value, "linear") == 0)
+        config.hashed = false;
+    else
+        return false;
+    return true;
+}
 
-    fat[0] = FAT_DIRECTORY;
+// Generate fat file, without options it is empty fat with just root dir
+void create(int argc, char *argv[])
+{
+    GeneratorConfig config;
+    config.clusterCount = atoi(argv[2]);
+    int size = atoi(argv[3]);
+    if (size <= 0 || size > INT16_MAX)
+    {
+        std::cout << "Cluster size must be between 1 and " << INT16_MAX << std::endl;
+        return;
+    }
+    config.clusterSize = (int16)size;
+    for (int i = 4; i < argc; i++)
+        if (!parseGeneratorOption(config, argv[i]))
+        {
+            std::cout << "Unknown generator option or wrong value " << argv[i] << std::endl;
+            return;
+        }
 
-    fwrite(&br, sizeof(BootRecord), 1, file);
-    for (uint8 i = 0; i < br.fat_copies; i++)
-        fwrite(fat, sizeof(int32)*cluster_count, 1, file);
+    try
+    {
+        Generator generator(config);
+        generator.generate(FAT::max_threads);
+        if (config.depth || config.files)
+            std::cout << "Generated " << generator.dirCount() << " dirs and " << generator.fileCount() << " files" << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+    }
+}
 
-    for (int32 j = 0; j < br.usable_cluster_count; j++)
-        fwrite(cluster, cluster_size, 1, file);
+// Format of counters printed with --stats
+static bool statsJson = false;
 
-    fclose(file);
-    delete[] cluster;
-    delete[] fat;
+// Parse global options (--option) placed in front of fat file path, returns number of consumed arguments or -1 on error
+int parseOptions(int argc, char *argv[])
+{
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+    {
+        if (strcmp(argv[i], "--mmap") == 0)
+            FAT::use_mmap = true;
+        else if (strcmp(argv[i], "--lazy") == 0)
+            FAT::lazy_load = true;
+        else if (strcmp(argv[i], "--single-fat") == 0)
+            FAT::single_fat = true;
+        else if (strcmp(argv[i], "--async") == 0)
+            FAT::async_load = true;
+        else if (strcmp(argv[i], "--journal") == 0)
+            FAT::use_journal = true;
+        else if (strcmp(argv[i], "--hashed-dirs") == 0)
+            FAT::hashed_dirs = true;
+        else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats-json") == 0)
+        {
+            statsJson = strcmp(argv[i], "--stats-json") == 0;
+            Stats::enable();
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            Trace::enable(argv[++i]);
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            FAT::cache_size = (uint64)atoi(argv[++i]) << 20;
+        else
+        {
+            std::cout << "Unknown option " << argv[i] << std::endl;
+            return -1;
+        }
+    }
+    return i - 1;
 }
 
 bool validateArguments(int argc, char *argv[])
@@ -46,16 +151,19 @@ bool validateArguments(int argc, char *argv[])
     if (argc < 3)
     {
         std::cout << "Not enough arguments." << std::endl;
-        std::cout << "Syntax <path to fat> <command>" << std::endl;
+        std::cout << "Syntax [options] <path to fat> <command>" << std::endl;
         return false;
     }
 
     if (strcmp("-g", argv[1]) == 0)
     {
-        if (argc == 4)
-            create(atoi(argv[2]), atoi(argv[3]));
+        if (argc >= 4)
+            create(argc, argv);
         else
-            std::cout << "Syntax for -g is <cluster count> <cluster size>" << std::endl;
+        {
+            std::cout << "Syntax for -g is <cluster count> <cluster size> [file=<fat file>] [depth=<levels>] [fanout=<subdirs>]" << std::endl;
+            std::cout << "    [files=<files in dir>] [size=<mean file size>] [dist=fixed|uniform|exp] [frag=<percent>] [bad=<per mille>] [seed=<n>] [threads=<n>] [layout=linear|hashed]" << std::endl;
+        }
         return false;
     }
     // Check if command is made from 2 and more characters since we select command from second one
@@ -69,6 +177,13 @@ bool validateArguments(int argc, char *argv[])
     {
     case 'a':
     {
+        // Check if arguments are <fatfile> <command> <name> <path>
+        if (argc != 5)
+        {
+            std::cout << "Not enough arguments for command (expected 4)" << std::endl;
+            std::cout << "Correct syntax is <fatfile> <command> <name> <path>" << std::endl;
+            return false;
+        }
         std::string s(argv[3]);
         FAT::extractFilename(s);
         if (s.length() >= 13)
@@ -81,6 +196,9 @@ bool validateArguments(int argc, char *argv[])
             std::cout << "Name ffffffff for file is forbidden!" << std::endl;
             return false;
         }
+        break;
+    }
+    case 'm':
         // Check if arguments are <fatfile> <command> <name> <path>
         if (argc != 5)
         {
@@ -88,9 +206,6 @@ bool validateArguments(int argc, char *argv[])
             std::cout << "Correct syntax is <fatfile> <command> <name> <path>" << std::endl;
             return false;
         }
-        break;
-    }
-    case 'm':
         if (strlen(argv[3]) >= 13)
         {
             std::cout << "Maximum name length is 12 characters" << std::endl;
@@ -101,16 +216,35 @@ bool validateArguments(int argc, char *argv[])
             std::cout << "Name ffffffff for directory is forbidden!" << std::endl;
             return false;
         }
-        // Check if arguments are <fatfile> <command> <name> <path>
-        if (argc != 5)
+        break;
+    case 'c':
+        // Check if arguments are <fatfile> <command> <path> [ranges]
+        if (argc != 4 && (argc != 5 || strcmp(argv[4], "ranges") != 0))
         {
-            std::cout << "Not enough arguments for command (expected 4)" << std::endl;
-            std::cout << "Correct syntax is <fatfile> <command> <name> <path>" << std::endl;
+            std::cout << "Not enough arguments for command (expected 3 or 4)" << std::endl;
+            std::cout << "Correct syntax is <fatfile> <command> <path> [ranges]" << std::endl;
+            return false;
+        }
+        break;
+    case 'v':
+        // Check if arguments are <fatfile> <command> [repair]
+        if (argc != 3 && (argc != 4 || strcmp(argv[3], "repair") != 0))
+        {
+            std::cout << "Not enough arguments for command (expected 2 or 3)" << std::endl;
+            std::cout << "Correct syntax is <fatfile> <command> [repair]" << std::endl;
+            return false;
+        }
+        break;
+    case 'z':
+        // Check if arguments are <fatfile> <command> [MB/s]
+        if (argc != 3 && (argc != 4 || atoi(argv[3]) < 0))
+        {
+            std::cout << "Not enough arguments for command (expected 2 or 3)" << std::endl;
+            std::cout << "Correct syntax is <fatfile> <command> [MB/s]" << std::endl;
             return false;
         }
         break;
     case 'f':
-    case 'c':
     case 'r':
     case 'l':
         // Check if arguments are <fatfile> <command> <path>
@@ -121,7 +255,17 @@ bool validateArguments(int argc, char *argv[])
             return false;
         }
         break;
+    case 'e':
+        // Check if arguments are <fatfile> <command> <path> [host file]
+        if (argc != 4 && argc != 5)
+        {
+            std::cout << "Not enough arguments for command (expected 3 or 4)" << std::endl;
+            std::cout << "Correct syntax is <fatfile> <command> <path> [host file]" << std::endl;
+            return false;
+        }
+        break;
     case 'p':
+    case 'i':
         // Check if arguments are <fatfile> <command>
         if (argc != 3)
         {
@@ -130,8 +274,19 @@ bool validateArguments(int argc, char *argv[])
             return false;
         }
         break;
+    case 's':
+        // Check if arguments are <fatfile> <command> <script>
+        if (argc != 4)
+        {
+            std::cout << "Not enough arguments for command (expected 3)" << std::endl;
+            std::cout << "Correct syntax is <fatfile> <command> <script file or - for stdin>" << std::endl;
+            return false;
+        }
+        break;
     // Testing command that i used for calculate load times for different thread numbers
     case 't':
+        if (argc != 4)
+            return false;
         FAT::max_threads = std::max(atoi(argv[3]), 1);
         break;
     case 'x':
@@ -151,14 +306,208 @@ bool validateArguments(int argc, char *argv[])
         std::cout << "-p for print filesystem" << std::endl;
         std::cout << "-f remove file from fat" << std::endl;
         std::cout << "-r remove dir from fat" << std::endl;
-        std::cout << "-c print clusters of file" << std::endl;
+        std::cout << "-c print clusters of file, with ranges as runs of consecutive clusters" << std::endl;
         std::cout << "-l print content of file" << std::endl;
+        std::cout << "-e export exact content of file into host file or stdout" << std::endl;
+        std::cout << "-i print statistics of clusters usage and fragmentation" << std::endl;
+        std::cout << "-v check consistency of fat, with repair fix found problems" << std::endl;
+        std::cout << "-z scrub all used clusters and relocate bad ones, reading can be limited to MB/s" << std::endl;
+        std::cout << "-s run commands from script file (- for stdin), one command per line, sync line writes pending changes" << std::endl;
+        std::cout << "Available options:" << std::endl;
+        std::cout << "--mmap access fat file through memory mapping" << std::endl;
+        std::cout << "--lazy load dirs only when path goes through them" << std::endl;
+        std::cout << "--single-fat keep only primary fat table in memory, mirrors are written from it" << std::endl;
+        std::cout << "--async load dirs with many reads in flight through io_uring, threads are used where it is not available" << std::endl;
+        std::cout << "--journal write metadata changes through journal file next to fat file, each command or script sync is one transaction, failed script command drops its transaction and stops script" << std::endl;
+        std::cout << "--hashed-dirs place dir entries by hash of name, with --lazy lookup reads only few clusters of dir made by layout=hashed" << std::endl;
+        std::cout << "--cache <MB> keep recently used clusters in memory cache of given size" << std::endl;
+        std::cout << "--trace <file> write timeline of loader threads and command phases as Chrome trace json" << std::endl;
+        std::cout << "--stats print performance counters of every thread to stderr at exit, --stats-json prints them as json" << std::endl;
         return false;
     }
 
     return true;
 }
 
+// Name of command phase in trace
+static const char* commandName(char command)
+{
+    switch (command)
+    {
+    case 'a': return "add file";
+    case 'm': return "create dir";
+    case 'f': return "remove file";
+    case 'r': return "remove dir";
+    case 'c': return "print clusters";
+    case 'l': return "print file";
+    case 'e': return "export file";
+    case 'p': return "print fat";
+    case 'i': return "print stats";
+    case 'v': return "check";
+    case 'z': return "scrub";
+    case 'x': return "print fat rows";
+    case 'b': return "corrupt cluster";
+    default: return "command";
+    }
+}
+
+// Execute one already validated command
+void executeCommand(FAT& fat, char *argv[])
+{
+    TraceSpan span(commandName(argv[2][1]));
+    switch (argv[2][1])
+    {
+        case 'a':
+            // Load and add file argv[3] int fat on path argv[4]
+            fat.addFile(argv[3], argv[4]);
+            break;
+        case 'm':
+            // Create dir named argv[3] in path argv[4]
+            fat.createDir(argv[3], argv[4]);
+            break;
+        case 'f':
+            // Remove file argv[3] from fat
+            fat.remove(argv[3], FAT_FILE_END);
+            break;
+        case 'r':
+            // Remove dir argv[3] from fat
+            fat.remove(argv[3], FAT_DIRECTORY);
+            break;
+        case 'c':
+            // Print list of file argv[3] clusters, as runs if argv[4] is ranges
+            fat.printFileClusters(argv[3], argv[4] != nullptr);
+            break;
+        case 'l':
+            // Print file argv[3] content
+            fat.printFile(argv[3]);
+            break;
+        case 'e':
+            // Export file argv[3] into host file argv[4], stdout if there is none
+            fat.exportFile(argv[3], argv[4] ? argv[4] : "");
+            break;
+        case 'p':
+            // Print file structure of fat
+            fat.printFat();
+            break;
+        case 'i':
+            // Print statistics of fat
+            fat.printStats();
+            break;
+        case 'v':
+            // Check fat, repair it if argv[3] is repair
+            fat.check(argv[3] != nullptr);
+            break;
+        case 'z':
+            // Scrub fat with reading limited to argv[3] MB/s
+            fat.scrub(argv[3] ? atoi(argv[3]) : 0);
+            break;
+        case 'x':
+            fat.printFirstFewFatRows();
+            break;
+        case 'b':
+            fat.corruptCluster(atoi(argv[3]));
+            break;
+    }
+}
+
+// Execute commands from script against one loaded fat, writes are deferred until sync line or end of script
+void runScript(FAT& fat, char* program, char* fatFile, std::string script)
+{
+    std::ifstream scriptFile;
+    if (script != "-")
+    {
+        scriptFile.open(script);
+        if (!scriptFile)
+            throw std::runtime_error("Cant open script file!");
+    }
+    std::istream& input = script == "-" ? std::cin : scriptFile;
+
+    fat.setDeferred(true);
+    uint32 lineNr = 0;
+    uint32 executed = 0;
+    uint32 failed = 0;
+    auto begin = std::chrono::steady_clock::now();
+
+    std::string line;
+    while (std::getline(input, line))
+    {
+        lineNr++;
+        std::istringstream tokens(line);
+        std::vector<std::string> words;
+        std::string word;
+        while (tokens >> word)
+            words.push_back(word);
+        // Skip empty lines and comments
+        if (words.empty() || words[0][0] == '#')
+            continue;
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = true;
+        bool thrown = false;
+        std::string error;
+        if (words[0] == "sync")
+            fat.sync();
+        else
+        {
+            // Build arguments same as if command was given on command line
+            std::vector<char*> args;
+            args.push_back(program);
+            args.push_back(fatFile);
+            for (auto& w : words)
+                args.push_back(&w[0]);
+            args.push_back(nullptr);
+
+            // Commands which would create new fat, change loading or nest scripts make no sense here
+            char command = words[0].size() > 1 ? words[0][1] : 0;
+            if (command == 'g' || command == 's' || command == 't')
+            {
+                ok = false;
+                error = "command not allowed in script";
+            }
+            else if (!validateArguments((int)args.size() - 1, args.data()))
+                ok = false;
+            else
+            {
+                try
+                {
+                    executeCommand(fat, args.data());
+                }
+                catch (std::exception& e)
+                {
+                    ok = false;
+                    thrown = true;
+                    error = e.what();
+                }
+            }
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        executed++;
+        if (!ok)
+            failed++;
+        std::cout << "[" << lineNr << "] " << (ok ? "ok" : "failed");
+        if (!error.empty())
+            std::cout << ": " << error;
+        std::cout << " (" << ms << " ms)" << std::endl;
+
+        // Failed command could be stopped in middle of its changes, with journal whole transaction since last sync is dropped
+        if (thrown && FAT::use_journal)
+        {
+            fat.abort();
+            std::cout << "Script stopped, changes since last sync were dropped" << std::endl;
+            return;
+        }
+    }
+
+    fat.setDeferred(false);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << "Executed " << executed << " commands, " << failed << " failed, in " << seconds * 1000 << " ms";
+    if (seconds > 0)
+        std::cout << " (" << (uint64)(executed / seconds) << " commands/s)";
+    std::cout << std::endl;
+    fat.printCacheStats();
+}
+
 int main(int argc, char *argv[]) 
 {
     // Seed randomizer
@@ -166,50 +515,31 @@ int main(int argc, char *argv[])
     // Initialize max_threads to default value
     FAT::max_threads = THREADS;
 
+    // Strip options so commands see <fatfile> <command> as before
+    int options = parseOptions(argc, argv);
+    if (options < 0)
+        return 0;
+    argv[options] = argv[0];
+    argv += options;
+    argc -= options;
+
     // Validate arguments
     if (!validateArguments(argc, argv))
         return 0;
     try
     {
         // Load fat file
+        uint64 start = Trace::now();
         FAT fat(argv[1]);
+        Trace::span("open", start);
 
-        switch (argv[2][1])
-        {
-            case 'a':
-                // Load and add file argv[3] int fat on path argv[4]
-                fat.addFile(argv[3], argv[4]);
-                break;
-            case 'm':
-                // Create dir named argv[3] in path argv[4]
-                fat.createDir(argv[3], argv[4]);
-                break;
-            case 'f':
-                // Remove file argv[3] from fat
-                fat.remove(argv[3], FAT_FILE_END);
-                break;
-            case 'r':
-                // Remove dir argv[3] from fat
-                fat.remove(argv[3], FAT_DIRECTORY);
-                break;
-            case 'c':
-                // Print list of file argv[3] clusters
-                fat.printFileClusters(argv[3]);
-                break;
-            case 'l':
-                // Print file argv[3] content
-                fat.printFile(argv[3]);
-                break;
-            case 'p':
-                // Print file structure of fat
-                fat.printFat();
-                break;
-            case 'x':
-                fat.printFirstFewFatRows();
-                break;
-            case 'b':
-                fat.corruptCluster(atoi(argv[3]));
-                break;
+        if (argv[2][1] == 's')
+            runScript(fat, argv[0], argv[1], argv[3]);
+        else
+        {
+            executeCommand(fat, argv);
+            // Deferred writes of command, with journal this commits its transaction
+            fat.sync();
         }
     }
     // Print error if occurred
@@ -217,5 +547,19 @@ int main(int argc, char *argv[])
     {
         std::cout << e.what() << std::endl;
     }
+    // Counters are complete only after fat was closed and its threads joined
+    if (Stats::enabled())
+        Stats::print(statsJson);
+    if (Trace::enabled())
+    {
+        try
+        {
+            Trace::write();
+        }
+        catch (std::exception& e)
+        {
+            std::cout << e.what() << std::endl;
+        }
+    }
     
 }
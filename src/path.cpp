@@ -0,0 +1,34 @@
+#include "path.h"
+
+PathTokenizer::PathTokenizer(const std::string& path)
+    : pos(path.data())
+    , end(path.data() + path.size())
+{
+}
+
+// Move to next name in path, false when there is none
+bool PathTokenizer::next(const char*& name, size_t& size)
+{
+    while (pos != end && *pos == '/')
+        pos++;
+    if (pos == end)
+        return false;
+
+    name = pos;
+    while (pos != end && *pos != '/')
+        pos++;
+    size = pos - name;
+    return true;
+}
+
+// FNV-1a hash of name
+uint32 hashName(const char* name, size_t size)
+{
+    uint32 hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (uint8)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
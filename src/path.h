@@ -0,0 +1,16 @@
+#pragma once
+#include "util.h"
+#include <string>
+
+// Splits path into names without copying them, empty names (leading, trailing or double /) are skipped
+class PathTokenizer
+{
+public:
+    PathTokenizer(const std::string& path);
+    bool next(const char*& name, size_t& size);
+private:
+    const char* pos;
+    const char* end;
+};
+
+uint32 hashName(const char* name, size_t size);
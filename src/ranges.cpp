@@ -0,0 +1,32 @@
+#include "ranges.h"
+
+#include <algorithm>
+#include <iterator>
+
+enum
+{
+    // Ranges closer than this many entries are written together, rewriting few clean entries is cheaper than another write
+    MERGE_GAP = 64
+};
+
+// Add range <start, end) and merge it with ranges it touches
+void DirtyRanges::add(int32 start, int32 end)
+{
+    // First range which may touch new one is the one before first range starting after it
+    auto itr = ranges.upper_bound(start);
+    if (itr != ranges.begin())
+    {
+        auto prev = std::prev(itr);
+        if (prev->second + MERGE_GAP >= start)
+            itr = prev;
+    }
+
+    // Swallow all ranges overlapping or close to new one
+    while (itr != ranges.end() && itr->first <= end + MERGE_GAP)
+    {
+        start = std::min(start, itr->first);
+        end = std::max(end, itr->second);
+        itr = ranges.erase(itr);
+    }
+    ranges[start] = end;
+}
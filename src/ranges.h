@@ -0,0 +1,19 @@
+#pragma once
+#include "util.h"
+#include <map>
+
+// Touched fat entries kept as sorted non overlapping ranges <start, end)
+class DirtyRanges
+{
+public:
+    void add(int32 start, int32 end);
+    void clear() { ranges.clear(); }
+    bool empty() { return ranges.empty(); }
+
+    typedef std::map<int32, int32>::const_iterator const_iterator;
+    const_iterator begin() const { return ranges.begin(); }
+    const_iterator end() const { return ranges.end(); }
+private:
+    // Start of range -> end of range
+    std::map<int32, int32> ranges;
+};
@@ -0,0 +1,188 @@
+#include "readahead.h"
+#include "image.h"
+#include "cache.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+Readahead::Readahead(ImageIO* _image, ClusterCache* _cache, const std::vector<Extent>& _extents, uint64 _dataStart, uint32 _clusterSize)
+    : image(_image)
+    , cache(_cache)
+    , extents(_extents)
+    , dataStart(_dataStart)
+    , clusterSize(_clusterSize)
+    , extent(0)
+    , position(0)
+    , pinned(-1)
+    , used(0)
+    , stop(false)
+    , finished(false)
+    , thread(nullptr)
+{
+    current.data = nullptr;
+    current.count = 0;
+    prefetchExtent(0);
+    if (image->data())
+    {
+        prefetchExtent(1);
+        return;
+    }
+    // Reader goes to disk, dirty clusters must be there before it so cache cant evict newer copy than it read
+    if (cache)
+        cache->flush();
+
+    // Buffer must hold at least one cluster even if clusters are bigger than readahead
+    size_t size = std::max<size_t>(READAHEAD_MAX, clusterSize);
+    for (int i = 0; i < READAHEAD_BUFFERS; i++)
+    {
+        buffers.push_back(new char[size]);
+        freeBuffers.push_back(buffers.back());
+    }
+    thread = new std::thread(&Readahead::reader, this);
+}
+
+Readahead::~Readahead()
+{
+    if (pinned >= 0)
+        cache->unpin(pinned);
+    if (thread)
+    {
+        {
+            Guard guard(lock);
+            stop = true;
+        }
+        changed.notify_all();
+        thread->join();
+        delete thread;
+    }
+    for (auto buffer : buffers)
+        delete[] buffer;
+}
+
+// Tell kernel to start reading whole extent
+void Readahead::prefetchExtent(size_t i)
+{
+    if (i < extents.size())
+        image->prefetch(offset(extents[i].start), (uint64)extents[i].length*clusterSize);
+}
+
+// Move to next cluster of extents, false after last one
+bool Readahead::step(int32& cluster)
+{
+    if (extent < extents.size() && position == extents[extent].length)
+    {
+        extent++;
+        position = 0;
+        // Next extent is requested while this one is used
+        prefetchExtent(extent + 1);
+    }
+    if (extent == extents.size())
+        return false;
+    cluster = extents[extent].start + position++;
+    return true;
+}
+
+// Next cluster of file and its number, nullptr after last cluster
+char* Readahead::next(int32& cluster)
+{
+    if (image->data())
+        return step(cluster) ? image->data() + offset(cluster) : nullptr;
+    // Previous cluster stays pinned while caller uses it
+    if (pinned >= 0)
+        cache->unpin(pinned);
+    pinned = -1;
+    char* data = read(cluster);
+    if (!data || !cache)
+        return data;
+    pinned = cluster;
+    return cache->fill(cluster, data);
+}
+
+// Next cluster from segments of reader thread
+char* Readahead::read(int32& cluster)
+{
+    if (current.data && used < current.count)
+    {
+        cluster = current.cluster + used;
+        return current.data + (size_t)clusterSize*used++;
+    }
+
+    {
+        Guard guard(lock);
+        // Previous segment was used, reader can fill its buffer again
+        if (current.data)
+        {
+            freeBuffers.push_back(current.data);
+            current.data = nullptr;
+            changed.notify_all();
+        }
+        while (ready.empty() && !finished)
+            changed.wait(guard);
+        if (ready.empty())
+            return nullptr;
+        current = ready.front();
+        ready.pop_front();
+    }
+    if (current.failed)
+        throw std::runtime_error("Failed read of cluster!");
+    used = 1;
+    cluster = current.cluster;
+    return current.data;
+}
+
+// Background thread reading segments into free buffers
+void Readahead::reader()
+{
+    Trace::threadName("readahead");
+    int32 maxWindow = std::max<int32>(1, READAHEAD_MAX / clusterSize);
+    int32 window = 1;
+    int32 previousEnd = -1;
+    for (size_t i = 0; i < extents.size(); i++)
+    {
+        prefetchExtent(i + 1);
+        int32 cluster = extents[i].start;
+        int32 left = extents[i].length;
+        while (left)
+        {
+            // Sequential access doubles window, jump starts again from one cluster
+            window = cluster == previousEnd ? std::min(window * 2, maxWindow) : 1;
+
+            Segment segment;
+            {
+                Guard guard(lock);
+                while (freeBuffers.empty() && !stop)
+                    changed.wait(guard);
+                if (stop)
+                    return;
+                segment.data = freeBuffers.back();
+                freeBuffers.pop_back();
+            }
+            segment.cluster = cluster;
+            segment.count = std::min(window, left);
+            size_t size = (size_t)segment.count*clusterSize;
+            uint64 readStart = Trace::now();
+            segment.failed = image->read(segment.data, size, offset(cluster)) != size;
+            Trace::span("readahead", readStart);
+
+            {
+                Guard guard(lock);
+                ready.push_back(segment);
+            }
+            changed.notify_all();
+            if (segment.failed)
+                break;
+            cluster += segment.count;
+            left -= segment.count;
+            previousEnd = cluster;
+        }
+        if (left)
+            break;
+    }
+
+    {
+        Guard guard(lock);
+        finished = true;
+    }
+    changed.notify_all();
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "util.h"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+
+class ImageIO;
+class ClusterCache;
+
+// Gives clusters of file in order, reads them ahead of consumer in background thread into ring of buffers.
+// Read window grows while file continues sequentially on disk and falls back to one cluster after jump.
+// Mapped file is walked in place, with cache read clusters are filled into it and cached ones are given instead.
+class Readahead
+{
+public:
+    Readahead(ImageIO* image, ClusterCache* cache, const std::vector<Extent>& extents, uint64 dataStart, uint32 clusterSize);
+    ~Readahead();
+
+    char* next(int32& cluster);
+private:
+    // Consecutive clusters read by one read
+    struct Segment
+    {
+        int32 cluster;
+        int32 count;
+        char* data;
+        bool failed;
+    };
+
+    void reader();
+    char* read(int32& cluster);
+    bool step(int32& cluster);
+    void prefetchExtent(size_t extent);
+    uint64 offset(int32 cluster) { return dataStart + (uint64)cluster*clusterSize; }
+
+    ImageIO* image;
+    ClusterCache* cache;
+    std::vector<Extent> extents;
+    uint64 dataStart;
+    uint32 clusterSize;
+
+    // Mapped file needs no buffers, clusters are walked in place
+    size_t extent;
+    int32 position;
+    int32 pinned;
+
+    std::vector<char*> buffers;
+    std::vector<char*> freeBuffers;
+    std::deque<Segment> ready;
+    Segment current;
+    int32 used;
+    bool stop;
+    bool finished;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread* thread;
+};
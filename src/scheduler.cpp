@@ -0,0 +1,78 @@
+#include "scheduler.h"
+#include "stats.h"
+
+// Push work at back, used only by owner thread
+void WorkDeque::push(const DirPart& work)
+{
+    Guard guard(lock, std::defer_lock);
+    Stats::lock(guard, STAT_DEQUE_WAITS);
+    works.push_back(work);
+}
+
+// Owner takes newest work, its cluster is most likely still hot and it keeps deques short on deep trees
+bool WorkDeque::pop(DirPart& work)
+{
+    Guard guard(lock, std::defer_lock);
+    Stats::lock(guard, STAT_DEQUE_WAITS);
+    if (works.empty())
+        return false;
+    work = works.back();
+    works.pop_back();
+    return true;
+}
+
+// Thieves take oldest work, which is usually closest to root and brings most of work with it
+bool WorkDeque::steal(DirPart& work)
+{
+    Guard guard(lock, std::defer_lock);
+    Stats::lock(guard, STAT_DEQUE_WAITS);
+    if (works.empty())
+        return false;
+    work = works.front();
+    works.pop_front();
+    return true;
+}
+
+WorkScheduler::WorkScheduler(uint8 workers)
+    : pending(0)
+{
+    for (uint8 i = 0; i < workers; i++)
+        deques.push_back(new WorkDeque());
+}
+
+WorkScheduler::~WorkScheduler()
+{
+    for (auto deque : deques)
+        delete deque;
+}
+
+// Add directory or its part to workers deque, must be called before done() of work in which it was found
+void WorkScheduler::push(uint8 worker, const DirPart& work)
+{
+    Stats::peak(STAT_QUEUE_PEAK, ++pending);
+    deques[worker]->push(work);
+}
+
+// Get work from own deque or steal it from others, returns false if there is nothing to do right now
+bool WorkScheduler::next(uint8 worker, DirPart& work)
+{
+    if (deques[worker]->pop(work))
+        return true;
+
+    for (size_t i = 1; i < deques.size(); i++)
+        if (deques[(worker + i) % deques.size()]->steal(work))
+            return true;
+    return false;
+}
+
+// Directory part was loaded and subdirectories found in it pushed
+void WorkScheduler::done()
+{
+    pending--;
+}
+
+// Nothing queued and nobody is loading, so nobody can push more work
+bool WorkScheduler::finished()
+{
+    return pending == 0;
+}
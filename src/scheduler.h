@@ -0,0 +1,45 @@
+#pragma once
+#include "util.h"
+#include <deque>
+#include <vector>
+#include <atomic>
+
+class Node;
+
+// Cluster of dir loaded by one worker, part -1 is dir which was not split into its clusters yet.
+// Parts of one dir share counter of parts which are not loaded, last one finishes dir.
+struct DirPart
+{
+    Node* node;
+    int32 part;
+    std::atomic<int32>* remaining;
+};
+
+// Deque of directories owned by one loader thread, owner works on back, idle threads steal from front
+class WorkDeque
+{
+public:
+    void push(const DirPart& work);
+    bool pop(DirPart& work);
+    bool steal(DirPart& work);
+private:
+    std::mutex lock;
+    std::deque<DirPart> works;
+};
+
+// Work-stealing scheduler for directory loading, every worker have own deque so no central queue is needed
+class WorkScheduler
+{
+public:
+    WorkScheduler(uint8 workers);
+    ~WorkScheduler();
+
+    void push(uint8 worker, const DirPart& work);
+    bool next(uint8 worker, DirPart& work);
+    void done();
+    bool finished();
+private:
+    std::vector<WorkDeque*> deques;
+    // Directories pushed but not loaded yet, zero means all work is done
+    std::atomic<uint32> pending;
+};
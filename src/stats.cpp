@@ -0,0 +1,119 @@
+#include "stats.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+bool Stats::on = false;
+
+// Threads register their counters on first use, they are kept until exit so counters of finished threads stay
+static std::mutex registryLock;
+static std::vector<ThreadStats*> registry;
+
+struct StatInfo
+{
+    const char* name;
+    // Peak counters are merged by maximum, others are summed
+    bool peak;
+};
+
+static const StatInfo statInfo[STAT_COUNT] =
+{
+    { "dir_reads", false },
+    { "dir_read_bytes", false },
+    { "dir_writes", false },
+    { "dir_write_bytes", false },
+    { "clear_writes", false },
+    { "clear_bytes", false },
+    { "moves", false },
+    { "move_bytes", false },
+    { "fat_writes", false },
+    { "fat_write_bytes", false },
+    { "cache_reads", false },
+    { "cache_read_bytes", false },
+    { "bad_cluster_checks", false },
+    { "dirs_loaded", false },
+    { "loader_idle_ns", false },
+    { "queue_peak", true },
+    { "deque_lock_waits", false },
+    { "deque_lock_wait_ns", false },
+    { "cache_lock_waits", false },
+    { "cache_lock_wait_ns", false },
+    { "bad_list_lock_waits", false },
+    { "bad_list_lock_wait_ns", false },
+};
+
+// Enable counters, calling thread becomes thread 0
+void Stats::enable()
+{
+    on = true;
+    local();
+}
+
+ThreadStats* Stats::local()
+{
+    static thread_local ThreadStats* stats = nullptr;
+    if (!stats)
+    {
+        stats = new ThreadStats();
+        Guard guard(registryLock);
+        stats->thread = (uint32)registry.size();
+        registry.push_back(stats);
+    }
+    return stats;
+}
+
+// Lock guard, time is measured only when lock is not free right away
+void Stats::lockMeasured(Guard& guard, statCounters waits)
+{
+    if (guard.try_lock())
+        return;
+    uint64 start = now();
+    guard.lock();
+    add(waits);
+    add((statCounters)(waits + 1), now() - start);
+}
+
+// Print totals and values of every thread, written to stderr so it doesnt mix with exported file on stdout
+void Stats::print(bool json)
+{
+    Guard guard(registryLock);
+    std::ostream& out = std::cerr;
+    if (json)
+    {
+        out << "{" << std::endl;
+        out << "  \"threads\": " << registry.size() << "," << std::endl;
+        out << "  \"counters\": {" << std::endl;
+    }
+    else
+    {
+        out << std::left << std::setw(24) << "Counter" << std::right << std::setw(14) << "Total";
+        for (auto stats : registry)
+            out << std::setw(14) << ("thread " + std::to_string(stats->thread));
+        out << std::endl;
+    }
+
+    for (uint32 i = 0; i < STAT_COUNT; i++)
+    {
+        uint64 total = 0;
+        for (auto stats : registry)
+            total = statInfo[i].peak ? std::max(total, stats->values[i]) : total + stats->values[i];
+
+        if (json)
+        {
+            out << "    \"" << statInfo[i].name << "\": { \"total\": " << total << ", \"threads\": [";
+            for (size_t j = 0; j < registry.size(); j++)
+                out << (j ? ", " : "") << registry[j]->values[i];
+            out << "] }" << (i + 1 < STAT_COUNT ? "," : "") << std::endl;
+        }
+        else
+        {
+            out << std::left << std::setw(24) << statInfo[i].name << std::right << std::setw(14) << total;
+            for (auto stats : registry)
+                out << std::setw(14) << stats->values[i];
+            out << std::endl;
+        }
+    }
+    if (json)
+        out << "  }" << std::endl << "}" << std::endl;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "util.h"
+#include <algorithm>
+#include <chrono>
+
+// Performance counters, every wait counter is followed by its time in nanoseconds
+enum statCounters
+{
+    STAT_DIR_READS,
+    STAT_DIR_READ_BYTES,
+    STAT_DIR_WRITES,
+    STAT_DIR_WRITE_BYTES,
+    STAT_CLEAR_WRITES,
+    STAT_CLEAR_BYTES,
+    STAT_MOVES,
+    STAT_MOVE_BYTES,
+    STAT_FAT_WRITES,
+    STAT_FAT_WRITE_BYTES,
+    STAT_CACHE_READS,
+    STAT_CACHE_READ_BYTES,
+    STAT_BAD_CHECKS,
+    STAT_DIRS_LOADED,
+    STAT_LOADER_IDLE_NS,
+    STAT_QUEUE_PEAK,
+    STAT_DEQUE_WAITS,
+    STAT_DEQUE_WAIT_NS,
+    STAT_CACHE_WAITS,
+    STAT_CACHE_WAIT_NS,
+    STAT_BAD_LIST_WAITS,
+    STAT_BAD_LIST_WAIT_NS,
+    STAT_COUNT
+};
+
+// Counters of one thread, only owner writes them so no atomics are needed, they are read after threads are joined
+struct ThreadStats
+{
+    uint32 thread;
+    uint64 values[STAT_COUNT];
+};
+
+// Per thread counters enabled by --stats, when disabled every call is just check of one flag
+class Stats
+{
+public:
+    static void enable();
+    static bool enabled() { return on; }
+
+    static void add(statCounters counter, uint64 value = 1)
+    {
+        if (on)
+            local()->values[counter] += value;
+    }
+    static void peak(statCounters counter, uint64 value)
+    {
+        if (on)
+            local()->values[counter] = std::max(local()->values[counter], value);
+    }
+    // Timestamp for measuring time spans, zero when disabled so nothing is measured
+    static uint64 now()
+    {
+        return on ? (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() : 0;
+    }
+    // Lock guard created with defer_lock, wait for lock is counted as waits and its time as counter after it
+    static void lock(Guard& guard, statCounters waits)
+    {
+        if (on)
+            lockMeasured(guard, waits);
+        else
+            guard.lock();
+    }
+    static void print(bool json);
+private:
+    static ThreadStats* local();
+    static void lockMeasured(Guard& guard, statCounters waits);
+
+    static bool on;
+};
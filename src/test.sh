@@ -59,6 +59,28 @@ echo "$FATSIM -l /big.txt > out.txt"
 echo " ";
 $FATSIM -l /big.txt > out.txt
 execute diff big.txt out.txt
+echo "----------------";
+echo "$FATSIM -e /big.txt out.txt"
+$FATSIM -e /big.txt out.txt
+execute diff big.txt out.txt
+echo "----------------";
+echo "Failed command in journal script drops removal, content of file stays"
+printf -- "-f /big.txt\n-r /nonexist\n" > abort.txt
+execute $1 --journal empty.fat -s abort.txt
+$FATSIM -l /big.txt > out.txt
+execute diff big.txt out.txt
+echo "----------------";
+echo "Root chain 0 -> 4000 -> 4001 -> 0 loops, loading must stop and repair must end chain"
+$1 -g 4098 256 file=loop.fat
+$1 loop.fat -m test /
+$1 loop.fat -a small.txt /test
+printf '\xa0\x0f\x00\x00' | dd of=loop.fat bs=1 seek=272 conv=notrunc 2> /dev/null
+printf '\xa1\x0f\x00\x00\x00\x00\x00\x00' | dd of=loop.fat bs=1 seek=16272 conv=notrunc 2> /dev/null
+execute timeout 10 $1 loop.fat -p
+execute $1 loop.fat -v repair
+$1 loop.fat -v | grep "found 0 problems"
+$1 loop.fat -l /test/small.txt > out.txt
+execute diff small.txt out.txt
           
 
 
@@ -0,0 +1,137 @@
+#include "trace.h"
+
+#include <fstream>
+#include <atomic>
+#include <vector>
+#include <iomanip>
+#include <stdexcept>
+
+enum
+{
+    // Spans kept by every thread, oldest ones are overwritten
+    TRACE_EVENTS = 1 << 16
+};
+
+// Ring of spans of one thread, count is published after event is written so writer sees only complete events
+struct TraceBuffer
+{
+    uint32 thread;
+    std::string name;
+    TraceEvent events[TRACE_EVENTS];
+    std::atomic<uint64> count;
+};
+
+bool Trace::on = false;
+static std::string traceFile;
+static uint64 traceStart;
+
+// Buffers are kept until trace is written. Buffer of finished thread goes to free list and next thread with same
+// name continues in it, so threads created for every command dont add new buffers.
+static std::mutex registryLock;
+static std::vector<TraceBuffer*> registry;
+static std::vector<TraceBuffer*> freeBuffers;
+
+// Take free buffer with given name or register new one
+static TraceBuffer* takeBuffer(const std::string& name)
+{
+    Guard guard(registryLock);
+    for (auto itr = freeBuffers.begin(); itr != freeBuffers.end(); itr++)
+    {
+        if ((*itr)->name != name)
+            continue;
+        TraceBuffer* buffer = *itr;
+        freeBuffers.erase(itr);
+        return buffer;
+    }
+    TraceBuffer* buffer = new TraceBuffer();
+    buffer->count = 0;
+    buffer->thread = (uint32)registry.size();
+    buffer->name = name;
+    registry.push_back(buffer);
+    return buffer;
+}
+
+static void releaseBuffer(TraceBuffer* buffer)
+{
+    Guard guard(registryLock);
+    freeBuffers.push_back(buffer);
+}
+
+// Buffer of thread, it is given back when thread exits
+struct LocalBuffer
+{
+    TraceBuffer* buffer;
+    ~LocalBuffer()
+    {
+        if (buffer)
+            releaseBuffer(buffer);
+    }
+};
+static thread_local LocalBuffer local = { nullptr };
+
+// Thread without name shares buffers with other unnamed threads
+static TraceBuffer* localBuffer()
+{
+    if (!local.buffer)
+        local.buffer = takeBuffer("worker");
+    return local.buffer;
+}
+
+// Enable tracing, calling thread becomes main thread of trace
+void Trace::enable(const std::string& filename)
+{
+    traceFile = filename;
+    on = true;
+    traceStart = now();
+    threadName("main");
+}
+
+// Name thread before it records spans, it gets buffer of finished thread with same name if there is one
+void Trace::threadName(const std::string& name)
+{
+    if (!on || (local.buffer && local.buffer->name == name))
+        return;
+    if (local.buffer)
+        releaseBuffer(local.buffer);
+    local.buffer = takeBuffer(name);
+}
+
+void Trace::record(const char* name, uint64 start)
+{
+    TraceBuffer* buffer = localBuffer();
+    uint64 count = buffer->count.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[count % TRACE_EVENTS];
+    event.name = name;
+    event.start = start;
+    event.duration = now() - start;
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+// Write all recorded spans, must be called after traced threads were joined
+void Trace::write()
+{
+    std::ofstream out(traceFile);
+    if (!out)
+        throw std::runtime_error("Cant create trace file!");
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [" << std::endl;
+
+    Guard guard(registryLock);
+    bool first = true;
+    for (auto buffer : registry)
+    {
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->thread
+            << ", \"args\": {\"name\": \"" << buffer->name << "\"}}";
+        first = false;
+
+        uint64 count = buffer->count.load(std::memory_order_acquire);
+        for (uint64 i = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0; i < count; i++)
+        {
+            TraceEvent& event = buffer->events[i % TRACE_EVENTS];
+            // Chrome wants microseconds
+            out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->thread
+                << ", \"ts\": " << (event.start - traceStart) / 1000.0 << ", \"dur\": " << event.duration / 1000.0 << "}";
+        }
+    }
+    out << std::endl << "]}" << std::endl;
+}
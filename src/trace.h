@@ -0,0 +1,49 @@
+#pragma once
+#include "util.h"
+#include <string>
+#include <chrono>
+
+// Timestamped span of one thread, name must live until trace is written
+struct TraceEvent
+{
+    const char* name;
+    uint64 start;
+    uint64 duration;
+};
+
+// Timeline of spans enabled by --trace, written at exit as Chrome trace event json which Perfetto can open too.
+// Every thread records into its own ring buffer, only owner writes it so recording takes no lock.
+class Trace
+{
+public:
+    static void enable(const std::string& filename);
+    static bool enabled() { return on; }
+
+    // Timestamp in nanoseconds, zero when disabled
+    static uint64 now()
+    {
+        return on ? (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() : 0;
+    }
+    static void span(const char* name, uint64 start)
+    {
+        if (on)
+            record(name, start);
+    }
+    static void threadName(const std::string& name);
+    static void write();
+private:
+    static void record(const char* name, uint64 start);
+
+    static bool on;
+};
+
+// Span from construction to end of scope
+class TraceSpan
+{
+public:
+    TraceSpan(const char* _name) : name(_name), start(Trace::now()) {}
+    ~TraceSpan() { Trace::span(name, start); }
+private:
+    const char* name;
+    uint64 start;
+};
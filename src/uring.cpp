@@ -0,0 +1,185 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+// Set up ring, on failure ring just stays closed
+IoRing::IoRing(uint32 entries)
+    : ringFd(-1)
+    , queued(0)
+    , pending(0)
+    , sqRing(MAP_FAILED)
+    , cqRing(MAP_FAILED)
+    , sqes((io_uring_sqe*)MAP_FAILED)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return;
+
+    sqRingSize = params.sq_off.array + params.sq_entries*sizeof(uint32);
+    cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+    // Newer kernels map both rings at once
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = single ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries*sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ringFd = fd;
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        release();
+        return;
+    }
+
+    char* sq = (char*)sqRing;
+    sqHead = (uint32*)(sq + params.sq_off.head);
+    sqTail = (uint32*)(sq + params.sq_off.tail);
+    sqMask = (uint32*)(sq + params.sq_off.ring_mask);
+    sqArray = (uint32*)(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    char* cq = (char*)cqRing;
+    cqHead = (uint32*)(cq + params.cq_off.head);
+    cqTail = (uint32*)(cq + params.cq_off.tail);
+    cqMask = (uint32*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+IoRing::~IoRing()
+{
+    drain();
+    release();
+}
+
+// Wait until kernel is done with every submitted read and drop their completions, kernel cant write into buffers after it
+void IoRing::drain()
+{
+    uint64 userData;
+    int32 result;
+    while (ringFd >= 0 && pending)
+    {
+        while (complete(userData, result))
+            ;
+        if (!pending)
+            break;
+        int res = (int)syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (res < 0 && errno != EINTR)
+            break;
+    }
+}
+
+// Unmap rings and close ring descriptor
+void IoRing::release()
+{
+    if (ringFd < 0)
+        return;
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    close(ringFd);
+    ringFd = -1;
+}
+
+// Queue read into buffer, it is started by next submit, false if submission queue is full
+bool IoRing::read(int fd, iovec* buffer, uint64 offset, uint64 userData)
+{
+    uint32 tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        return false;
+
+    uint32 index = tail & *sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    // Vectored read is supported since first io_uring kernel
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64)buffer;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    sqArray[index] = index;
+    // Kernel must see filled entry before new tail
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return true;
+}
+
+// Start queued reads and wait until at least waitFor of them complete, returns -errno on failure
+int IoRing::submit(uint32 waitFor)
+{
+    while (true)
+    {
+        int res = (int)syscall(__NR_io_uring_enter, ringFd, queued, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (res >= 0)
+        {
+            res = std::min<int>(res, queued);
+            queued -= res;
+            pending += res;
+            return res;
+        }
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+// Take one completed read, false if none is ready
+bool IoRing::complete(uint64& userData, int32& result)
+{
+    uint32 head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        return false;
+    io_uring_cqe* cqe = &cqes[head & *cqMask];
+    userData = cqe->user_data;
+    result = cqe->res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    pending -= std::min<uint32>(pending, 1);
+    return true;
+}
+#else
+// No io_uring on this platform, callers fall back to threads
+IoRing::IoRing(uint32)
+    : ringFd(-1)
+{
+}
+
+IoRing::~IoRing()
+{
+}
+
+void IoRing::drain()
+{
+}
+
+void IoRing::release()
+{
+}
+
+bool IoRing::read(int, iovec*, uint64, uint64)
+{
+    return false;
+}
+
+int IoRing::submit(uint32)
+{
+    return -1;
+}
+
+bool IoRing::complete(uint64&, int32&)
+{
+    return false;
+}
+#endif
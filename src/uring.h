@@ -0,0 +1,47 @@
+#pragma once
+#include "util.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+struct iovec;
+
+// Minimal io_uring submission and completion ring used through raw syscalls, opened() is false where kernel or platform doesnt support it.
+// Destructor waits for reads in flight, so their buffers must outlive the ring.
+class IoRing
+{
+public:
+    IoRing(uint32 entries);
+    ~IoRing();
+    bool opened() { return ringFd >= 0; }
+
+    bool read(int fd, struct iovec* buffer, uint64 offset, uint64 userData);
+    int submit(uint32 waitFor);
+    bool complete(uint64& userData, int32& result);
+private:
+    void drain();
+    void release();
+
+    int ringFd;
+    uint32 queued;
+    // Reads taken by kernel whose completion wasnt taken yet
+    uint32 pending;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    uint32* sqHead;
+    uint32* sqTail;
+    uint32* sqMask;
+    uint32* sqArray;
+    uint32 sqEntries;
+    uint32* cqHead;
+    uint32* cqTail;
+    uint32* cqMask;
+    struct io_uring_cqe* cqes;
+};
@@ -17,6 +17,20 @@ typedef std::unique_lock<std::mutex> Guard;
 enum
 {
     THREADS = 3,
-    RANDOM_RANGE = 100
+    RANDOM_RANGE = 100,
+    // Size of chunks in which imported files are read
+    IMPORT_CHUNK = 8 << 20,
+    // Number of dir cluster reads kept in flight by async loader
+    ASYNC_DEPTH = 64,
+    // Biggest read and number of buffers of file readahead
+    READAHEAD_MAX = 1 << 20,
+    READAHEAD_BUFFERS = 4
 };
 
+
+// Run of consecutive clusters
+struct Extent
+{
+    int32 start;
+    int32 length;
+};